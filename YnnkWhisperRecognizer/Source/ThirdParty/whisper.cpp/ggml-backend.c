@@ -615,6 +615,8 @@ struct ggml_backend_cpu_context {
     int n_threads;
     void * work_data;
     size_t work_size;
+
+    struct ggml_threadpool * threadpool; // not owned
 };
 
 static const char * ggml_backend_cpu_name(ggml_backend_t backend) {
@@ -647,6 +649,7 @@ static ggml_backend_graph_plan_t ggml_backend_cpu_graph_plan_create(ggml_backend
     struct ggml_backend_plan_cpu * cpu_plan = (ggml_backend_plan_cpu*)FMemory::Malloc(sizeof(struct ggml_backend_plan_cpu));
 
     cpu_plan->cplan = ggml_graph_plan(cgraph, cpu_ctx->n_threads);
+    cpu_plan->cplan.threadpool = cpu_ctx->threadpool;
     cpu_plan->cgraph = *cgraph; // FIXME: deep copy
 
     if (cpu_plan->cplan.work_size > 0) {
@@ -685,6 +688,7 @@ static bool ggml_backend_cpu_graph_compute(ggml_backend_t backend, struct ggml_c
     }
 
     cplan.work_data = (uint8_t*)cpu_ctx->work_data;
+    cplan.threadpool = cpu_ctx->threadpool;
 
     ggml_graph_compute(cgraph, &cplan);
     return true;
@@ -722,6 +726,7 @@ ggml_backend_t ggml_backend_cpu_init(void) {
     ctx->n_threads = GGML_DEFAULT_N_THREADS;
     ctx->work_data = NULL;
     ctx->work_size = 0;
+    ctx->threadpool = NULL;
 
     ggml_backend_t cpu_backend = (ggml_backend_t)FMemory::Malloc(sizeof(struct ggml_backend));
 
@@ -743,6 +748,13 @@ void ggml_backend_cpu_set_n_threads(ggml_backend_t backend_cpu, int n_threads) {
     ctx->n_threads = n_threads;
 }
 
+void ggml_backend_cpu_set_threadpool(ggml_backend_t backend_cpu, struct ggml_threadpool * threadpool) {
+    GGML_ASSERT(ggml_backend_is_cpu(backend_cpu));
+
+    struct ggml_backend_cpu_context * ctx = (struct ggml_backend_cpu_context *)backend_cpu->context;
+    ctx->threadpool = threadpool;
+}
+
 ggml_backend_buffer_t ggml_backend_cpu_buffer_from_ptr(void * ptr, size_t size) {
     return ggml_backend_buffer_init(ggml_backend_cpu_buffer_type(), cpu_backend_buffer_i_from_ptr, ptr, size);
 }
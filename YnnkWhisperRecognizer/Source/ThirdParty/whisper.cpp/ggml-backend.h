@@ -83,6 +83,10 @@ extern "C" {
     GGML_API bool ggml_backend_is_cpu(ggml_backend_t backend);
     GGML_API void ggml_backend_cpu_set_n_threads(ggml_backend_t backend_cpu, int n_threads);
 
+    // use persistent compute threads instead of creating new ones for every graph
+    // the pool is not owned by the backend and must outlive it (or be reset to NULL)
+    GGML_API void ggml_backend_cpu_set_threadpool(ggml_backend_t backend_cpu, struct ggml_threadpool * threadpool);
+
     // Create a backend buffer from an existing pointer
     GGML_API ggml_backend_buffer_t ggml_backend_cpu_buffer_from_ptr(void * ptr, size_t size);
 
@@ -16239,6 +16239,44 @@ typedef pthread_t ggml_thread_t;
 
 #endif
 
+#if defined(_WIN32)
+
+typedef SRWLOCK            ggml_mutex_t;
+typedef CONDITION_VARIABLE ggml_cond_t;
+
+#define ggml_mutex_init(x)     InitializeSRWLock(x)
+#define ggml_mutex_destroy(x)  UNUSED(x)
+#define ggml_mutex_lock(x)     AcquireSRWLockExclusive(x)
+#define ggml_mutex_unlock(x)   ReleaseSRWLockExclusive(x)
+
+#define ggml_cond_init(x)      InitializeConditionVariable(x)
+#define ggml_cond_destroy(x)   UNUSED(x)
+#define ggml_cond_wait(x, m)   SleepConditionVariableSRW(x, m, INFINITE, 0)
+#define ggml_cond_broadcast(x) WakeAllConditionVariable(x)
+
+#else
+
+typedef pthread_mutex_t ggml_mutex_t;
+typedef pthread_cond_t  ggml_cond_t;
+
+#define ggml_mutex_init(x)     pthread_mutex_init(x, NULL)
+#define ggml_mutex_destroy(x)  pthread_mutex_destroy(x)
+#define ggml_mutex_lock(x)     pthread_mutex_lock(x)
+#define ggml_mutex_unlock(x)   pthread_mutex_unlock(x)
+
+#define ggml_cond_init(x)      pthread_cond_init(x, NULL)
+#define ggml_cond_destroy(x)   pthread_cond_destroy(x)
+#define ggml_cond_wait(x, m)   pthread_cond_wait(x, m)
+#define ggml_cond_broadcast(x) pthread_cond_broadcast(x)
+
+#endif
+
+#if defined(__x86_64__) || (defined(_MSC_VER) && defined(_M_AMD64))
+#define ggml_cpu_relax() _mm_pause()
+#else
+#define ggml_cpu_relax() ((void) 0)
+#endif
+
 // Android's libc implementation "bionic" does not support setting affinity
 #if defined(__linux__) && !defined(__BIONIC__)
 static void set_numa_thread_affinity(int thread_n, int n_threads) {
@@ -16315,6 +16353,30 @@ struct ggml_compute_state {
     ggml_thread_t thrd;
     int ith;
     struct ggml_compute_state_shared * shared;
+    struct ggml_threadpool * threadpool; // set only for the workers of a persistent pool
+};
+
+// number of busy-wait iterations before an idle pool worker goes to sleep
+// decoder graphs follow each other with a short sampling gap, so the workers are usually
+// still spinning when the next graph arrives and no syscall is needed to wake them up
+#define GGML_THREADPOOL_N_SPIN (1 << 14)
+
+struct ggml_threadpool {
+    int n_threads; // including the thread calling ggml_graph_compute()
+
+    struct ggml_compute_state * workers; // [n_threads], workers[0] is not used
+
+    // the graph currently being computed, valid while n_done < n_threads - 1
+    struct ggml_compute_state_shared * shared;
+
+    atomic_int n_graph; // incremented for every new graph
+    atomic_int n_done;  // number of workers which are done with the current graph
+
+    // used to park the workers which spun for too long
+    ggml_mutex_t mutex;
+    ggml_cond_t  cond;
+    int  n_parked; // protected by mutex
+    bool stop;     // protected by mutex
 };
 
 static void ggml_graph_compute_perf_stats_node(struct ggml_tensor * node, const struct ggml_compute_state_shared * st) {
@@ -16675,6 +16737,137 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
     return GGML_EXIT_SUCCESS;
 }
 
+static thread_ret_t ggml_threadpool_thread(void * data) {
+    struct ggml_compute_state * state = (struct ggml_compute_state *) data;
+    struct ggml_threadpool * pool = state->threadpool;
+
+    int last_graph = 0;
+
+    while (true) {
+        // spin for a while, then sleep until the next graph is submitted
+        int n_graph = atomic_load(&pool->n_graph);
+        for (int i = 0; n_graph == last_graph && i < GGML_THREADPOOL_N_SPIN; ++i) {
+            ggml_cpu_relax();
+            n_graph = atomic_load(&pool->n_graph);
+        }
+
+        if (n_graph == last_graph) {
+            ggml_mutex_lock(&pool->mutex);
+            while ((n_graph = atomic_load(&pool->n_graph)) == last_graph && !pool->stop) {
+                pool->n_parked++;
+                ggml_cond_wait(&pool->cond, &pool->mutex);
+                pool->n_parked--;
+            }
+            const bool stop = pool->stop;
+            ggml_mutex_unlock(&pool->mutex);
+
+            if (stop) {
+                break;
+            }
+        }
+
+        last_graph = n_graph;
+
+        // the graph may be computed with less threads than the pool has
+        state->shared = pool->shared;
+        if (state->ith < state->shared->n_threads) {
+            ggml_graph_compute_thread(state);
+        }
+
+        // every worker acknowledges every graph, so none of them can fall behind
+        atomic_fetch_add(&pool->n_done, 1);
+    }
+
+    return 0;
+}
+
+struct ggml_threadpool * ggml_threadpool_new(int n_threads) {
+    GGML_ASSERT(n_threads > 0);
+
+    struct ggml_threadpool * pool = (struct ggml_threadpool *) malloc(sizeof(struct ggml_threadpool));
+
+    pool->n_threads = n_threads;
+    pool->workers   = (struct ggml_compute_state *) malloc(sizeof(struct ggml_compute_state)*n_threads);
+    pool->shared    = NULL;
+    pool->n_parked  = 0;
+    pool->stop      = false;
+
+    atomic_store(&pool->n_graph, 0);
+    atomic_store(&pool->n_done,  0);
+
+    ggml_mutex_init(&pool->mutex);
+    ggml_cond_init(&pool->cond);
+
+    for (int j = 0; j < n_threads; ++j) {
+        pool->workers[j] = ggml_compute_state {
+            /*.thrd       =*/ ggml_thread_t(),
+            /*.ith        =*/ j,
+            /*.shared     =*/ NULL,
+            /*.threadpool =*/ pool,
+        };
+    }
+
+    for (int j = 1; j < n_threads; ++j) {
+        const int rc = ggml_thread_create(&pool->workers[j].thrd, NULL, ggml_threadpool_thread, &pool->workers[j]);
+        GGML_ASSERT(rc == 0);
+        UNUSED(rc);
+    }
+
+    return pool;
+}
+
+void ggml_threadpool_free(struct ggml_threadpool * pool) {
+    if (!pool) {
+        return;
+    }
+
+    ggml_mutex_lock(&pool->mutex);
+    pool->stop = true;
+    ggml_cond_broadcast(&pool->cond);
+    ggml_mutex_unlock(&pool->mutex);
+
+    for (int j = 1; j < pool->n_threads; ++j) {
+        const int rc = ggml_thread_join(pool->workers[j].thrd, NULL);
+        GGML_ASSERT(rc == 0);
+        UNUSED(rc);
+    }
+
+    ggml_cond_destroy(&pool->cond);
+    ggml_mutex_destroy(&pool->mutex);
+
+    free(pool->workers);
+    free(pool);
+}
+
+int ggml_threadpool_n_threads(const struct ggml_threadpool * pool) {
+    return pool ? pool->n_threads : 0;
+}
+
+// run the graph on the persistent workers, the calling thread is worker 0
+static int ggml_threadpool_compute(struct ggml_threadpool * pool, struct ggml_compute_state_shared * shared) {
+    pool->shared = shared;
+    atomic_store(&pool->n_done, 0);
+
+    ggml_mutex_lock(&pool->mutex);
+    atomic_fetch_add(&pool->n_graph, 1);
+    if (pool->n_parked > 0) {
+        ggml_cond_broadcast(&pool->cond);
+    }
+    ggml_mutex_unlock(&pool->mutex);
+
+    struct ggml_compute_state * state = &pool->workers[0];
+    state->shared = shared;
+
+    const int compute_status = (size_t) ggml_graph_compute_thread(state);
+
+    // the workers still reference the shared state on our stack
+    while (atomic_load(&pool->n_done) < pool->n_threads - 1) {
+        ggml_cpu_relax();
+    }
+
+    return compute_status;
+}
+
 struct ggml_cplan ggml_graph_plan(const struct ggml_cgraph * cgraph, int n_threads) {
     if (n_threads <= 0) {
         n_threads = GGML_DEFAULT_N_THREADS;
@@ -16892,15 +17085,20 @@ int ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cplan * cplan) {
         /*.abort_callback          =*/ NULL,
         /*.abort_callback_data     =*/ NULL,
     };
-    struct ggml_compute_state * workers = (ggml_compute_state*)alloca(sizeof(struct ggml_compute_state)*n_threads);
+
+    // reuse persistent threads if the caller provided a large enough pool
+    const bool use_threadpool = n_threads > 1 && cplan->threadpool && cplan->threadpool->n_threads >= n_threads;
+
+    struct ggml_compute_state * workers = use_threadpool ? NULL : (ggml_compute_state*)alloca(sizeof(struct ggml_compute_state)*n_threads);
 
     // create thread pool
-    if (n_threads > 1) {
+    if (!use_threadpool && n_threads > 1) {
         for (int j = 1; j < n_threads; ++j) {
             workers[j] = ggml_compute_state {
-                /*.thrd   =*/ ggml_thread_t(),
-                /*.ith =*/ j,
-                /*.shared =*/ &state_shared,
+                /*.thrd       =*/ ggml_thread_t(),
+                /*.ith        =*/ j,
+                /*.shared     =*/ &state_shared,
+                /*.threadpool =*/ NULL,
             };
 
             const int rc = ggml_thread_create(&workers[j].thrd, NULL, ggml_graph_compute_thread, &workers[j]);
@@ -16909,20 +17107,26 @@ int ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cplan * cplan) {
         }
     }
 
-    workers[0].ith = 0;
-    workers[0].shared = &state_shared;
-
     const int64_t perf_start_cycles  = ggml_perf_cycles();
     const int64_t perf_start_time_us = ggml_perf_time_us();
 
-    // this is a work thread too
-    int compute_status = (size_t) ggml_graph_compute_thread(&workers[0]);
+    int compute_status = GGML_EXIT_SUCCESS;
+
+    if (use_threadpool) {
+        compute_status = ggml_threadpool_compute(cplan->threadpool, &state_shared);
+    } else {
+        workers[0].ith = 0;
+        workers[0].shared = &state_shared;
+
+        // this is a work thread too
+        compute_status = (size_t) ggml_graph_compute_thread(&workers[0]);
+    }
 
     // don't leave affinity set on the main thread
     clear_numa_thread_affinity();
 
     // join or kill thread pool
-    if (n_threads > 1) {
+    if (!use_threadpool && n_threads > 1) {
         for (int j = 1; j < n_threads; j++) {
             const int rc = ggml_thread_join(workers[j].thrd, NULL);
             GGML_ASSERT(rc == 0);
@@ -322,6 +322,7 @@ extern "C" {
 
     struct ggml_object;
     struct ggml_context;
+    struct ggml_threadpool;
 
     enum ggml_type {
         GGML_TYPE_F32  = 0,
@@ -564,6 +565,10 @@ extern "C" {
         // abort ggml_graph_compute when true
         bool (*abort_callback)(void * data);
         void * abort_callback_data;
+
+        // optional persistent worker threads (see ggml_threadpool_new())
+        // if NULL, threads are created and joined on every ggml_graph_compute() call
+        struct ggml_threadpool * threadpool;
     };
 
     enum ggml_cgraph_eval_order {
@@ -1850,6 +1855,14 @@ extern "C" {
     GGML_API struct ggml_cplan ggml_graph_plan   (const struct ggml_cgraph * cgraph, int n_threads /*= GGML_DEFAULT_N_THREADS*/);
     GGML_API int               ggml_graph_compute(      struct ggml_cgraph * cgraph, struct ggml_cplan * cplan);
 
+    // persistent compute threads which can be reused by many ggml_graph_compute() calls
+    // n_threads includes the calling thread, so the pool creates n_threads - 1 workers
+    // workers spin for a short time after a graph is finished and then sleep until the next graph
+    // a pool must not be used by several ggml_graph_compute() calls simultaneously
+    GGML_API struct ggml_threadpool * ggml_threadpool_new      (int n_threads);
+    GGML_API void                     ggml_threadpool_free     (struct ggml_threadpool * threadpool);
+    GGML_API int                      ggml_threadpool_n_threads(const struct ggml_threadpool * threadpool);
+
     // same as ggml_graph_compute() but the work data is allocated as a part of the context
     // note: the drawback of this API is that you must have ensured that the context has enough memory for the work data
     GGML_API void ggml_graph_compute_with_ctx(struct ggml_context * ctx, struct ggml_cgraph * cgraph, int n_threads);
@@ -29,7 +29,10 @@
 #include <cstdarg>
 #include <cstring>
 #include <fstream>
+#include <list>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <set>
 #include <string>
 #include <thread>
@@ -38,10 +41,41 @@
 #include <random>
 #include <functional>
 
+#if defined(__AVX__) || defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #if defined(_MSC_VER)
 #pragma warning(disable: 4244 4267) // possible loss of data
 #endif
 
+#ifndef WHISPER_USE_MMAP
+#if defined(_WIN32) || defined(__unix__) || defined(__APPLE__) || defined(__ANDROID__)
+#define WHISPER_USE_MMAP 1
+#else
+#define WHISPER_USE_MMAP 0
+#endif
+#endif
+
+#if WHISPER_USE_MMAP
+#if defined(_WIN32)
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#endif
+
 #if defined(GGML_BIG_ENDIAN)
 #include <bit>
 
@@ -145,6 +179,7 @@ static void whisper_log_callback_default(ggml_log_level level, const char * text
 
 //#define WHISPER_USE_FLASH_ATTN
 //#define WHISPER_USE_FLASH_FF
+//#define WHISPER_MEL_FILTERS_REFERENCE // apply the full mel filterbank with double accumulation (for validation)
 #define WHISPER_MAX_DECODERS 8
 #define WHISPER_MAX_NODES 4096
 
@@ -171,21 +206,6 @@ static bool ggml_graph_compute_helper(
     return ggml_graph_compute(graph, &plan);
 }
 
-static bool ggml_graph_compute_helper(
-       struct ggml_backend * backend,
-        struct ggml_cgraph * graph,
-                       int   n_threads) {
-    if (ggml_backend_is_cpu(backend)) {
-        ggml_backend_cpu_set_n_threads(backend, n_threads);
-    }
-#ifdef GGML_USE_METAL
-    if (ggml_backend_is_metal(backend)) {
-        ggml_backend_metal_set_n_cb(backend, n_threads);
-    }
-#endif
-    return ggml_backend_graph_compute(backend, graph);
-}
-
 // faster matrix multiplications for tensors that do not have dimension 0 divisible by "pad"
 // the idea is to represent the original matrix multiplication:
 //
@@ -355,11 +375,41 @@ struct whisper_mel {
     std::vector<float> data;
 };
 
+// number of mel frames kept by the streaming extractor (30 seconds)
+#define WHISPER_STREAM_N_FRAMES (WHISPER_CHUNK_SIZE*WHISPER_SAMPLE_RATE/WHISPER_HOP_LENGTH)
+
+// incremental log mel spectrogram of a live audio stream, see whisper_stream_push_pcm()
+struct whisper_mel_stream {
+    bool started = false; // the reflective pad at the beginning has been applied
+
+    std::vector<float> pcm;  // padded samples still needed by the next frames
+    int64_t pcm_offset = 0;  // padded sample index of pcm[0]
+    int64_t n_frames   = 0;  // number of frames computed since the last reset
+
+    // last WHISPER_STREAM_N_FRAMES*WHISPER_HOP_LENGTH input samples, sample i is stored at i % size
+    // needed for the signal energy used by the token-level timestamps
+    std::vector<float> ring_pcm;
+    int64_t n_samples = 0;   // number of samples pushed since the last reset
+
+    // raw log10 mel of the last WHISPER_STREAM_N_FRAMES frames, frame i is stored in column i % n_len
+    whisper_mel ring = { 0, 0, 0, {} };
+
+    // per-stream scratch buffers
+    std::vector<float> hann;
+    std::vector<float> fft_in;
+    std::vector<float> fft_work;
+    std::vector<float> fft_out;
+};
+
 struct whisper_filters {
     int32_t n_mel;
     int32_t n_fft;
 
     std::vector<float> data;
+
+    // non-zero bins of every filter: data[j*n_fft + start[j]] ... data[j*n_fft + start[j] + len[j] - 1]
+    std::vector<int32_t> start;
+    std::vector<int32_t> len;
 };
 
 struct whisper_vocab {
@@ -367,6 +417,7 @@ struct whisper_vocab {
     using token = std::string;
 
     int n_vocab = 51864;
+    int n_vocab_file = 0; // number of tokens stored in the model file, the rest are generated on load
 
     std::map<token, id> token_to_id;
     std::map<id, token> id_to_token;
@@ -664,6 +715,142 @@ struct whisper_kv_cache {
     ggml_backend_buffer_t buffer;
 };
 
+// read-only memory mapping of a model file
+struct whisper_mmap {
+    void * addr = nullptr;
+    size_t size = 0;
+
+#if defined(_WIN32)
+    HANDLE hmap = NULL;
+#endif
+
+    whisper_mmap() = default;
+    whisper_mmap(const whisper_mmap &) = delete;
+    whisper_mmap & operator=(const whisper_mmap &) = delete;
+
+    bool open(const char * path) {
+#if !WHISPER_USE_MMAP
+        GGML_UNUSED(path);
+        return false;
+#elif defined(_WIN32)
+        HANDLE hfile = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (hfile == INVALID_HANDLE_VALUE) {
+            return false;
+        }
+
+        LARGE_INTEGER file_size;
+        if (!GetFileSizeEx(hfile, &file_size) || file_size.QuadPart == 0) {
+            CloseHandle(hfile);
+            return false;
+        }
+
+        // the mapping keeps the file open
+        hmap = CreateFileMappingA(hfile, NULL, PAGE_READONLY, 0, 0, NULL);
+        CloseHandle(hfile);
+        if (hmap == NULL) {
+            return false;
+        }
+
+        addr = MapViewOfFile(hmap, FILE_MAP_READ, 0, 0, 0);
+        if (addr == NULL) {
+            CloseHandle(hmap);
+            hmap = NULL;
+            return false;
+        }
+        size = (size_t) file_size.QuadPart;
+        return true;
+#else
+        const int fd = ::open(path, O_RDONLY);
+        if (fd == -1) {
+            return false;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+            close(fd);
+            return false;
+        }
+
+        // shared read-only pages: all processes loading the same file use the same page cache
+        void * ptr = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (ptr == MAP_FAILED) {
+            return false;
+        }
+
+#ifdef POSIX_MADV_WILLNEED
+        posix_madvise(ptr, (size_t) st.st_size, POSIX_MADV_WILLNEED);
+#endif
+
+        addr = ptr;
+        size = (size_t) st.st_size;
+        return true;
+#endif
+    }
+
+    ~whisper_mmap() {
+#if WHISPER_USE_MMAP
+        if (addr) {
+#if defined(_WIN32)
+            UnmapViewOfFile(addr);
+            CloseHandle(hmap);
+#else
+            munmap(addr, size);
+#endif
+        }
+#endif
+    }
+};
+
+// whisper_model_loader over memory owned by someone else; with can_map tensors point directly into it
+struct whisper_memory_reader {
+    const uint8_t * data;
+    size_t size;
+    size_t offset;
+
+    static size_t read(void * ctx, void * output, size_t read_size) {
+        whisper_memory_reader * reader = (whisper_memory_reader *) ctx;
+
+        const size_t size_to_copy = std::min(read_size, reader->size - reader->offset);
+
+        memcpy(output, reader->data + reader->offset, size_to_copy);
+        reader->offset += size_to_copy;
+
+        return size_to_copy;
+    }
+
+    static bool eof(void * ctx) {
+        whisper_memory_reader * reader = (whisper_memory_reader *) ctx;
+        return reader->offset >= reader->size;
+    }
+
+    static void * map(void * ctx, size_t read_size) {
+        whisper_memory_reader * reader = (whisper_memory_reader *) ctx;
+        if (reader->size - reader->offset < read_size) {
+            return nullptr;
+        }
+
+        void * result = (void *) (reader->data + reader->offset);
+        reader->offset += read_size;
+
+        return result;
+    }
+
+    static void close(void * /*ctx*/) { }
+
+    whisper_model_loader make_loader(bool can_map) {
+        whisper_model_loader loader = {};
+
+        loader.context = this;
+        loader.read    = &whisper_memory_reader::read;
+        loader.eof     = &whisper_memory_reader::eof;
+        loader.close   = &whisper_memory_reader::close;
+        loader.map     = can_map ? &whisper_memory_reader::map : nullptr;
+
+        return loader;
+    }
+};
+
 struct whisper_model {
     e_model type = MODEL_UNKNOWN;
 
@@ -699,11 +886,16 @@ struct whisper_model {
     std::vector<whisper_layer_decoder> layers_decoder;
 
     // ggml context that contains all the meta information about the model tensors
-    struct ggml_context * ctx;
+    struct ggml_context * ctx = nullptr;
 
     // the model backend data is read-only and can be shared between processors
     std::vector<struct ggml_backend_buffer *> buffers;
 
+    // memory-mapped model file; CPU tensors point into it
+    std::unique_ptr<whisper_mmap> mapping;
+    bool mapped    = false; // tensor data points into the loader memory
+    bool quantized = false; // F16 weights of the model file were quantized on load
+
     // tensors
     int n_loaded;
     std::map<std::string, struct ggml_tensor *> tensors;
@@ -777,6 +969,7 @@ struct whisper_state {
 
     int32_t n_sample = 0; // number of tokens sampled
     int32_t n_encode = 0; // number of encoder calls
+    int32_t n_encode_cached = 0; // number of encoder calls served from whisper_encoder_cache
     int32_t n_decode = 0; // number of decoder calls with n_tokens == 1  (text-generation)
     int32_t n_batchd = 0; // number of decoder calls with n_tokens <  16 (batch decoding)
     int32_t n_prompt = 0; // number of decoder calls with n_tokens >  1  (prompt encoding)
@@ -792,12 +985,17 @@ struct whisper_state {
 
     whisper_mel mel;
 
+    whisper_mel_stream mel_stream;
+
     whisper_batch batch;
 
     whisper_decoder decoders[WHISPER_MAX_DECODERS];
 
     ggml_backend_t backend = nullptr;
 
+    // persistent compute threads used by the CPU backend, see ggml_graph_compute_helper()
+    ggml_threadpool * threadpool = nullptr;
+
     // ggml-alloc:
     // - stores meta info about the intermediate tensors into the `meta` buffers
     // - stores the actual tensor data into the `data` buffers
@@ -821,6 +1019,7 @@ struct whisper_state {
     std::vector<whisper_token>   prompt_past;
 
     int lang_id = 0; // english by default
+    float lang_prob = 0.0f; // probability of the auto-detected language, 0 if it wasn't detected
 
     std::string path_model; // populated by whisper_init_from_file_with_params()
 
@@ -844,6 +1043,75 @@ struct whisper_state {
     int32_t exp_n_audio_ctx = 0; // 0 - use default
 };
 
+static bool ggml_graph_compute_helper(
+      struct whisper_state & wstate,
+        struct ggml_cgraph * graph,
+                       int   n_threads) {
+    ggml_backend_t backend = wstate.backend;
+
+    if (ggml_backend_is_cpu(backend)) {
+        // keep the compute threads alive between graphs - a single transcription runs
+        // three encoder graphs and one decoder graph per generated token
+        if (n_threads > 1 && ggml_threadpool_n_threads(wstate.threadpool) != n_threads) {
+            ggml_threadpool_free(wstate.threadpool);
+            wstate.threadpool = ggml_threadpool_new(n_threads);
+        }
+
+        ggml_backend_cpu_set_n_threads(backend, n_threads);
+        ggml_backend_cpu_set_threadpool(backend, n_threads > 1 ? wstate.threadpool : nullptr);
+    }
+#ifdef GGML_USE_METAL
+    if (ggml_backend_is_metal(backend)) {
+        ggml_backend_metal_set_n_cb(backend, n_threads);
+    }
+#endif
+    return ggml_backend_graph_compute(backend, graph);
+}
+
+// LRU cache of the encoder outputs, i. e. data of embd_enc and kv_cross computed for a mel window
+struct whisper_encoder_cache {
+    // identity of the mel window: the index key and an independent hash and length verified on lookup
+    struct window_key {
+        uint64_t hash  = 0;
+        uint64_t check = 0;
+        int n_len       = 0;
+        int n_audio_ctx = 0;
+
+        bool operator==(const window_key & other) const {
+            return hash == other.hash && check == other.check && n_len == other.n_len && n_audio_ctx == other.n_audio_ctx;
+        }
+    };
+
+    struct entry {
+        window_key key;
+
+        std::vector<uint8_t> embd;
+        std::vector<uint8_t> k;
+        std::vector<uint8_t> v;
+
+        size_t size() const {
+            return embd.size() + k.size() + v.size();
+        }
+    };
+
+    std::mutex mutex;
+
+    size_t max_size = 0; // bytes, 0 = disabled
+    size_t size     = 0;
+
+    // most recently used first; entries are shared, so they can be copied to a state outside of the lock
+    std::list<std::shared_ptr<const entry>> entries;
+    std::map<uint64_t, std::list<std::shared_ptr<const entry>>::iterator> index;
+
+    void evict(size_t budget) {
+        while (size > budget && !entries.empty()) {
+            size -= entries.back()->size();
+            index.erase(entries.back()->key.hash);
+            entries.pop_back();
+        }
+    }
+};
+
 struct whisper_context {
     int64_t t_load_us  = 0;
     int64_t t_start_us = 0;
@@ -861,6 +1129,8 @@ struct whisper_context {
     ggml_backend_t backend = nullptr;
 
     std::string path_model; // populated by whisper_init_from_file_with_params()
+
+    whisper_encoder_cache encoder_cache;
 };
 
 struct whisper_global {
@@ -1176,6 +1446,23 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
             return false;
         }
 
+        // optionally quantize F16 weights while loading them
+        if (wctx.params.quantize_ftype != GGML_FTYPE_UNKNOWN && wctx.params.quantize_ftype != hparams.ftype) {
+            const ggml_type qtype = ggml_ftype_to_ggml_type(wctx.params.quantize_ftype);
+
+            if (wctx.wtype != GGML_TYPE_F16) {
+                WHISPER_LOG_WARN("%s: only F16 models can be quantized on load, keeping ftype %d\n", __func__, hparams.ftype);
+            } else if (qtype == GGML_TYPE_COUNT || !ggml_is_quantized(qtype) ||
+                       hparams.n_audio_state % ggml_blck_size(qtype) != 0 || hparams.n_text_state % ggml_blck_size(qtype) != 0) {
+                WHISPER_LOG_WARN("%s: can't quantize model to ftype %d, keeping F16\n", __func__, wctx.params.quantize_ftype);
+            } else {
+                WHISPER_LOG_INFO("%s: quantizing weights to %s\n", __func__, ggml_type_name(qtype));
+                wctx.wtype      = qtype;
+                hparams.ftype   = wctx.params.quantize_ftype;
+                model.quantized = true;
+            }
+        }
+
         WHISPER_LOG_INFO("%s: n_vocab       = %d\n", __func__, hparams.n_vocab);
         WHISPER_LOG_INFO("%s: n_audio_ctx   = %d\n", __func__, hparams.n_audio_ctx);
         WHISPER_LOG_INFO("%s: n_audio_state = %d\n", __func__, hparams.n_audio_state);
@@ -1201,6 +1488,22 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
         filters.data.resize(filters.n_mel * filters.n_fft);
         loader->read(loader->context, filters.data.data(), filters.data.size() * sizeof(float));
         BYTESWAP_FILTERS(filters);
+
+        // the filters are triangular, so each one covers only a few of the FFT bins
+        filters.start.resize(filters.n_mel);
+        filters.len.resize(filters.n_mel);
+
+        for (int j = 0; j < filters.n_mel; ++j) {
+            const float * row = filters.data.data() + j * filters.n_fft;
+
+            int k0 = 0;
+            int k1 = filters.n_fft;
+            while (k0 < k1 && row[k0]     == 0.0f) ++k0;
+            while (k1 > k0 && row[k1 - 1] == 0.0f) --k1;
+
+            filters.start[j] = k0;
+            filters.len[j]   = k1 - k0;
+        }
     }
 
     const std::vector<std::string> digit_tokens = {
@@ -1211,6 +1514,7 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
     {
         int32_t n_vocab = 0;
         read_safe(loader, n_vocab);
+        vocab.n_vocab_file = n_vocab;
 
         //if (n_vocab != model.hparams.n_vocab) {
         //    WHISPER_LOG_ERROR("%s: invalid model file '%s' (bad vocab size %d != %d)\n",
@@ -1308,6 +1612,9 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
     const ggml_type wtype = wctx.wtype;
     const ggml_type vtype = wctx.wtype == GGML_TYPE_F32 ? GGML_TYPE_F32 : GGML_TYPE_F16; // conv type
 
+    // F16 weights of the model file are converted to wtype while loading
+    const bool quantize = model.quantized;
+
     // create the ggml context
     {
         const auto & hparams = model.hparams;
@@ -1528,6 +1835,14 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
 
     wctx.backend = whisper_backend_init(wctx.params);
 
+    // CPU tensors can use model data provided by the loader in place (i. e. memory-mapped file).
+    // legacy ggml files are packed, so tensors which aren't aligned for their type are copied (see below).
+    bool use_map = loader->map != nullptr && ggml_backend_is_cpu(wctx.backend);
+#if defined(GGML_BIG_ENDIAN)
+    use_map = false; // tensors are byteswapped after reading
+#endif
+    use_map = use_map && !quantize; // quantized tensors are stored in allocated buffers
+
     // some devices have a limit on the maximum size of single memory buffer
     // for example, iPhones are limited to 1GB per buffer
     // to workaround this, we will allocate multiple buffers of smaller size and will split the tensors with the
@@ -1543,7 +1858,7 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
 
     std::map<std::string, int> map_t2b;
 
-    {
+    if (!use_map) {
         size_t size_main = 0;
         size_t size_cur  = 0;
 
@@ -1577,26 +1892,69 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
         WHISPER_LOG_INFO("%s: %8s total size = %8.2f MB (%d buffers)\n", __func__, ggml_backend_name(wctx.backend), size_main / 1e6, (int) model.buffers.size());
     }
 
-    std::vector<ggml_allocr *> allocs(model.buffers.size());
+    // allocators are freed on every return; buffers (including copies of misaligned mapped tensors) are owned by
+    // the model and freed by whisper_free, the mapping is owned by the caller
+    struct allocr_list : std::vector<ggml_allocr *> {
+        using std::vector<ggml_allocr *>::vector;
+        ~allocr_list() {
+            for (auto & alloc : *this) {
+                ggml_allocr_free(alloc);
+            }
+        }
+    };
+
+    allocr_list allocs(model.buffers.size());
     for (size_t i = 0; i < allocs.size(); ++i) {
         allocs[i] = ggml_allocr_new_from_buffer(model.buffers[i]);
     }
 
     // allocate tensors in the backend buffers
-    {
+    if (!use_map) {
         for (const auto & t : model.tensors) {
             ggml_allocr_alloc(allocs[map_t2b[t.first]], t.second);
         }
     }
 
+    // range of the loader memory used by mapped tensors
+    const uint8_t * map_begin = nullptr;
+    const uint8_t * map_end   = nullptr;
+    int n_map_copied = 0;
+
+    // alignment of the tensor data expected by the CPU kernels: the largest power of two dividing
+    // the element (block) size, e. g. 4 for f32 and 2 for f16 and q4_0
+    auto map_alignment = [](ggml_type type) {
+        const size_t type_size = ggml_type_size(type);
+        return std::min<size_t>(type_size & (~type_size + 1), 8);
+    };
+
     // load weights
     {
         size_t total_size = 0;
 
         model.n_loaded = 0;
 
+        size_t expected_size = 0;
+        for (const auto & t : model.tensors) {
+            expected_size += ggml_nbytes(t.second);
+        }
+
+        // returns false if loading is aborted by the callback
+        auto tensor_loaded = [&](const ggml_tensor * tensor) {
+            total_size += ggml_nbytes(tensor);
+            model.n_loaded++;
+
+            if (wctx.params.load_progress_callback) {
+                return wctx.params.load_progress_callback(total_size, expected_size, model.n_loaded, (int) model.tensors.size(), wctx.params.load_progress_callback_user_data);
+            }
+            return true;
+        };
+
         std::vector<char> read_buf;
 
+        std::vector<float>   quant_f32;
+        std::vector<char>    quant_buf;
+        std::vector<int64_t> quant_hist(1 << 4, 0);
+
         while (true) {
             int32_t n_dims;
             int32_t length;
@@ -1644,17 +2002,75 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
 
             const size_t bpe = ggml_type_size(ggml_type(ttype));
 
-            if ((nelements*bpe)/ggml_blck_size(tensor->type) != ggml_nbytes(tensor)) {
+            // F16 weights are quantized on load to the type of the tensor, other data is used as stored
+            const bool convert = quantize && ttype == GGML_TYPE_F16 && tensor->type == wtype;
+            const size_t nbytes = convert
+                ? (nelements/ggml_blck_size(tensor->type))*ggml_type_size(tensor->type)
+                : (nelements*bpe)/ggml_blck_size(tensor->type);
+
+            if (nbytes != ggml_nbytes(tensor)) {
                 WHISPER_LOG_ERROR("%s: tensor '%s' has wrong size in model file: got %zu, expected %zu\n",
-                        __func__, name.data(), ggml_nbytes(tensor), nelements*bpe);
+                        __func__, name.data(), ggml_nbytes(tensor), nbytes);
                 return false;
             }
 
+            if (convert) {
+                // F16 data -> F32 -> wtype
+                read_buf.resize(nelements*bpe);
+                loader->read(loader->context, read_buf.data(), read_buf.size());
+
+                quant_f32.resize(nelements);
+                ggml_fp16_to_fp32_row((const ggml_fp16_t *) read_buf.data(), quant_f32.data(), nelements);
+
+                void * dst = tensor->data;
+                if (!ggml_backend_is_cpu(wctx.backend)) {
+                    quant_buf.resize(ggml_nbytes(tensor));
+                    dst = quant_buf.data();
+                }
+
+                ggml_quantize_chunk(wtype, quant_f32.data(), dst, 0, nelements/ne[0], ne[0], quant_hist.data(), nullptr);
+
+                if (dst != tensor->data) {
+                    ggml_backend_tensor_set(tensor, dst, 0, ggml_nbytes(tensor));
+                }
+
+                if (!tensor_loaded(tensor)) {
+                    WHISPER_LOG_INFO("%s: loading aborted\n", __func__);
+                    return false;
+                }
+                continue;
+            }
+
             ggml_backend_t backend = wctx.backend;
 
             //printf("%s: [%5.5s] %s\n", __func__, ggml_backend_name(backend), name.c_str());
 
-            if ((ggml_backend_is_cpu(backend)
+            if (use_map) {
+                uint8_t * data = (uint8_t *) loader->map(loader->context, ggml_nbytes(tensor));
+                if (data == nullptr) {
+                    WHISPER_LOG_ERROR("%s: failed to map tensor '%s'\n", __func__, name.data());
+                    return false;
+                }
+
+                if ((uintptr_t) data % map_alignment(tensor->type) != 0) {
+                    // misaligned tensor is copied to its own buffer
+                    ggml_backend_buffer_t buffer = ggml_backend_alloc_buffer(backend, ggml_nbytes(tensor));
+                    if (buffer == nullptr) {
+                        WHISPER_LOG_ERROR("%s: failed to allocate buffer for tensor '%s'\n", __func__, name.data());
+                        return false;
+                    }
+                    model.buffers.push_back(buffer);
+
+                    tensor->data   = ggml_backend_buffer_get_base(buffer);
+                    tensor->buffer = buffer;
+                    memcpy(tensor->data, data, ggml_nbytes(tensor));
+                    n_map_copied++;
+                } else {
+                    tensor->data = data;
+                    map_begin = map_begin ? std::min<const uint8_t *>(map_begin, data) : data;
+                    map_end   = std::max<const uint8_t *>(map_end, data + ggml_nbytes(tensor));
+                }
+            } else if ((ggml_backend_is_cpu(backend)
 #ifdef GGML_USE_METAL
                 || ggml_backend_is_metal(backend)
 #endif
@@ -1672,8 +2088,10 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
             }
 
             //printf("%48s - [%5d, %5d, %5d], type = %6s, %6.2f MB\n", name.data(), ne[0], ne[1], ne[2], ggml_type_name((ggml_type) ttype), ggml_nbytes(tensor)/1e6);
-            total_size += ggml_nbytes(tensor);
-            model.n_loaded++;
+            if (!tensor_loaded(tensor)) {
+                WHISPER_LOG_INFO("%s: loading aborted\n", __func__);
+                return false;
+            }
         }
 
         WHISPER_LOG_INFO("%s: model size    = %7.2f MB\n", __func__, total_size/1e6);
@@ -1684,10 +2102,23 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
             WHISPER_LOG_ERROR("%s: ERROR not all tensors loaded from model file - expected %zu, got %d\n", __func__, model.tensors.size(), model.n_loaded);
             return false;
         }
-    }
 
-    for (auto & alloc : allocs) {
-        ggml_allocr_free(alloc);
+        // a single non-owning buffer covers all mapped tensors
+        if (use_map && map_begin) {
+            ggml_backend_buffer_t buffer = ggml_backend_cpu_buffer_from_ptr((void *) map_begin, map_end - map_begin);
+            for (const auto & t : model.tensors) {
+                if (t.second->buffer == nullptr) {
+                    t.second->buffer = buffer;
+                }
+            }
+            model.buffers.push_back(buffer);
+            model.mapped = true;
+
+            WHISPER_LOG_INFO("%s: %8s mapped size = %8.2f MB\n", __func__, ggml_backend_name(wctx.backend), (map_end - map_begin) / 1e6);
+        }
+        if (n_map_copied > 0) {
+            WHISPER_LOG_INFO("%s: %d misaligned tensors copied from the mapped model\n", __func__, n_map_copied);
+        }
     }
 
     wctx.t_load_us = ggml_time_us() - t_start_us;
@@ -2129,6 +2560,41 @@ static struct ggml_cgraph * whisper_build_graph_cross(
     return gf;
 }
 
+// identity of the mel window which is the encoder input (see whisper_build_graph_conv)
+static whisper_encoder_cache::window_key whisper_mel_window_key(const whisper_mel & mel, int mel_offset, int n_audio_ctx) {
+    const int i0 = std::min(mel_offset,                 mel.n_len);
+    const int i1 = std::min(mel_offset + 2*n_audio_ctx, mel.n_len);
+
+    // two independent hashes over 32-bit words: FNV-1a with the high half folded back to mix all bits,
+    // and a multiply-rotate hash with another constant, so a collision needs both to collide
+    uint64_t hash  = 0xcbf29ce484222325ULL;
+    uint64_t check = 0x9e3779b97f4a7c15ULL;
+    auto combine = [&hash, &check](uint32_t word) {
+        hash = (hash ^ word)*0x100000001b3ULL;
+        hash ^= hash >> 32;
+
+        check = (check + word)*0xff51afd7ed558ccdULL;
+        check = (check << 31) | (check >> 33);
+    };
+
+    for (int j = 0; j < mel.n_mel; ++j) {
+        const float * row = mel.data.data() + (size_t) j*mel.n_len;
+        for (int i = i0; i < i1; ++i) {
+            uint32_t word;
+            memcpy(&word, row + i, sizeof(word));
+            combine(word);
+        }
+    }
+
+    whisper_encoder_cache::window_key key;
+    key.hash        = hash;
+    key.check       = check;
+    key.n_len       = i1 - i0;
+    key.n_audio_ctx = n_audio_ctx;
+
+    return key;
+}
+
 // evaluate the encoder with the given state
 //
 // given audio recording (more specifically, its log mel spectrogram), runs forward pass of the encoder
@@ -2148,6 +2614,41 @@ static bool whisper_encode_internal(
                    void * abort_callback_data) {
     const int64_t t_start_us = ggml_time_us();
 
+    auto & cache = wctx.encoder_cache;
+
+    const int n_audio_ctx = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : wctx.model.hparams.n_audio_ctx;
+
+    // used part of kv_cross: n_text_layer blocks of n_audio_ctx x n_state
+    const size_t kv_cross_size = ggml_element_size(wstate.kv_cross.k)*wctx.model.hparams.n_audio_state*n_audio_ctx*wctx.model.hparams.n_text_layer;
+
+    // output of the encoder: n_audio_ctx x n_state, F32
+    const size_t embd_size = sizeof(float)*wctx.model.hparams.n_audio_state*n_audio_ctx;
+
+    const size_t entry_size = embd_size + 2*kv_cross_size;
+
+    bool use_cache = false;
+    whisper_encoder_cache::window_key cache_key;
+    {
+        std::lock_guard<std::mutex> lock(cache.mutex);
+        use_cache = cache.max_size >= entry_size && !whisper_encode_external(wstate);
+    }
+
+    std::shared_ptr<const whisper_encoder_cache::entry> cached;
+
+    if (use_cache) {
+        cache_key = whisper_mel_window_key(wstate.mel, mel_offset, n_audio_ctx);
+
+        std::lock_guard<std::mutex> lock(cache.mutex);
+        auto it = cache.index.find(cache_key.hash);
+        if (it != cache.index.end() && (*it->second)->key == cache_key) {
+            cache.entries.splice(cache.entries.begin(), cache.entries, it->second);
+            cached = *it->second;
+        }
+    }
+
+    // on a cache hit the graphs are still built and allocated, but not computed:
+    // embd_enc gets its tensor for this window and is restored from the cache like kv_cross
+
     // conv
     {
         auto & alloc = wstate.alloc_conv.alloc;
@@ -2158,8 +2659,8 @@ static bool whisper_encode_internal(
 
         ggml_allocr_alloc_graph(alloc, gf);
 
-        if (!whisper_encode_external(wstate)) {
-            if (!ggml_graph_compute_helper(wstate.backend, gf, n_threads)) {
+        if (!cached && !whisper_encode_external(wstate)) {
+            if (!ggml_graph_compute_helper(wstate, gf, n_threads)) {
                 return false;
             }
         }
@@ -2175,11 +2676,25 @@ static bool whisper_encode_internal(
 
         ggml_allocr_alloc_graph(alloc, gf);
 
-        if (!ggml_graph_compute_helper(wstate.backend, gf, n_threads)) {
-            return false;
+        if (!cached) {
+            if (!ggml_graph_compute_helper(wstate, gf, n_threads)) {
+                return false;
+            }
         }
     }
 
+    if (cached) {
+        GGML_ASSERT(ggml_nbytes(wstate.embd_enc) == cached->embd.size());
+        ggml_backend_tensor_set(wstate.embd_enc, cached->embd.data(), 0, cached->embd.size());
+        ggml_backend_tensor_set(wstate.kv_cross.k, cached->k.data(), 0, cached->k.size());
+        ggml_backend_tensor_set(wstate.kv_cross.v, cached->v.data(), 0, cached->v.size());
+
+        wstate.t_encode_us += ggml_time_us() - t_start_us;
+        wstate.n_encode_cached++;
+
+        return !(abort_callback && abort_callback(abort_callback_data));
+    }
+
     // cross
     {
         auto & alloc = wstate.alloc_cross.alloc;
@@ -2190,11 +2705,32 @@ static bool whisper_encode_internal(
 
         ggml_allocr_alloc_graph(alloc, gf);
 
-        if (!ggml_graph_compute_helper(wstate.backend, gf, n_threads)) {
+        if (!ggml_graph_compute_helper(wstate, gf, n_threads)) {
             return false;
         }
     }
 
+    if (use_cache) {
+        auto stored = std::make_shared<whisper_encoder_cache::entry>();
+        stored->key = cache_key;
+        GGML_ASSERT(ggml_nbytes(wstate.embd_enc) == embd_size);
+        stored->embd.resize(embd_size);
+        ggml_backend_tensor_get(wstate.embd_enc, stored->embd.data(), 0, embd_size);
+        stored->k.resize(kv_cross_size);
+        stored->v.resize(kv_cross_size);
+        ggml_backend_tensor_get(wstate.kv_cross.k, stored->k.data(), 0, kv_cross_size);
+        ggml_backend_tensor_get(wstate.kv_cross.v, stored->v.data(), 0, kv_cross_size);
+
+        std::lock_guard<std::mutex> lock(cache.mutex);
+        // the same window could be encoded by another state meanwhile, cache size could be changed
+        if (cache.max_size >= entry_size && cache.index.find(cache_key.hash) == cache.index.end()) {
+            cache.evict(cache.max_size - entry_size);
+            cache.entries.push_front(std::move(stored));
+            cache.index[cache_key.hash] = cache.entries.begin();
+            cache.size += entry_size;
+        }
+    }
+
     wstate.t_encode_us += ggml_time_us() - t_start_us;
     wstate.n_encode++;
 
@@ -2614,7 +3150,7 @@ static bool whisper_decode_internal(
 
         logits = gf->nodes[gf->n_nodes - 1];
 
-        if (!ggml_graph_compute_helper(wstate.backend, gf, n_threads)) {
+        if (!ggml_graph_compute_helper(wstate, gf, n_threads)) {
             return false;
         }
     }
@@ -2667,101 +3203,449 @@ static std::string to_timestamp(int64_t t, bool comma = false) {
     return std::string(buf);
 }
 
-#define SIN_COS_N_COUNT WHISPER_N_FFT
-static float sin_vals[SIN_COS_N_COUNT];
-static float cos_vals[SIN_COS_N_COUNT];
+// Planned real FFT used for the frames of the mel spectrogram
+//
+// A real sequence of even length n is transformed as a complex sequence of length n/2 (even samples
+// as the real part, odd samples as the imaginary part) and the spectrum is untangled afterwards;
+// a sequence of odd length is transformed as a complex sequence of length n.
+// The complex FFT is an iterative mixed-radix (4, 2, 3, 5, any other prime) Stockham transform: all
+// twiddle factors are computed once per size and the transform itself never allocates. Data is kept as
+// separate real/imaginary arrays, and the loops over the stride use explicit SIMD (AVX, SSE or NEON),
+// so they don't depend on auto-vectorization by the compiler.
+
+struct whisper_rfft_stage {
+    int radix;
+    int n; // length of the sub-transforms at this stage
+    int s; // stride
+
+    // exp(-2*pi*i*p*k/n) for p in [0, n/radix), k in [1, radix)
+    std::vector<float> tw_re;
+    std::vector<float> tw_im;
+
+    // exp(-2*pi*i*k/radix) for k in [0, radix), used by the generic butterfly of primes above 5
+    std::vector<float> rot_re;
+    std::vector<float> rot_im;
+};
 
-// In FFT, we frequently use sine and cosine operations with the same values.
-// We can use precalculated values to speed up the process.
-static void fill_sin_cos_table() {
-    static bool is_filled = false;
-    if (is_filled) return;
-    for (int i = 0; i < SIN_COS_N_COUNT; i++) {
-        double theta = (2*M_PI*i)/SIN_COS_N_COUNT;
-        sin_vals[i] = sinf(theta);
-        cos_vals[i] = cosf(theta);
-    }
-    is_filled = true;
-}
+struct whisper_rfft_plan {
+    int n = 0;      // real input length
+    int m = 0;      // complex transform length (n/2 for even n, n for odd n)
+    int n_work = 0; // floats of the work memory needed by whisper_rfft_power
+
+    bool packed = false; // even and odd samples are packed to a complex sequence of length n/2
 
-// naive Discrete Fourier Transform
-// input is real-valued
-// output is complex-valued
-static void dft(const std::vector<float> & in, std::vector<float> & out) {
-    int N = in.size();
+    std::vector<whisper_rfft_stage> stages;
 
-    out.resize(N*2);
-    const int sin_cos_step = SIN_COS_N_COUNT / N;
+    // exp(-2*pi*i*k/n) for k in [0, m], packed transform only
+    std::vector<float> post_re;
+    std::vector<float> post_im;
+};
+
+static whisper_rfft_plan whisper_rfft_plan_init(int n) {
+    GGML_ASSERT(n > 0);
+
+    whisper_rfft_plan plan;
+    plan.n      = n;
+    plan.packed = n % 2 == 0;
+    plan.m      = plan.packed ? n/2 : n;
+    plan.n_work = 4*plan.m;
+
+    int len = plan.m;
+    int s   = 1;
+    while (len > 1) {
+        int radix = 0;
+        if      (len % 4 == 0) radix = 4;
+        else if (len % 2 == 0) radix = 2;
+        else if (len % 3 == 0) radix = 3;
+        else if (len % 5 == 0) radix = 5;
+        else {
+            // the smallest prime factor
+            radix = 7;
+            while (len % radix != 0) {
+                radix += 2;
+            }
+        }
 
-    for (int k = 0; k < N; k++) {
-        float re = 0;
-        float im = 0;
+        whisper_rfft_stage stage;
+        stage.radix = radix;
+        stage.n     = len;
+        stage.s     = s;
 
-        for (int n = 0; n < N; n++) {
-            int idx = (k * n * sin_cos_step) % (SIN_COS_N_COUNT); // t = 2*M_PI*k*n/N
-            re += in[n]*cos_vals[idx]; // cos(t)
-            im -= in[n]*sin_vals[idx]; // sin(t)
+        const int m = len/radix;
+        stage.tw_re.resize(m*(radix - 1));
+        stage.tw_im.resize(m*(radix - 1));
+        for (int p = 0; p < m; ++p) {
+            for (int k = 1; k < radix; ++k) {
+                const double theta = (2*M_PI*p*k)/len;
+                stage.tw_re[p*(radix - 1) + k - 1] =  cos(theta);
+                stage.tw_im[p*(radix - 1) + k - 1] = -sin(theta);
+            }
         }
 
-        out[k*2 + 0] = re;
-        out[k*2 + 1] = im;
+        if (radix > 5) {
+            stage.rot_re.resize(radix);
+            stage.rot_im.resize(radix);
+            for (int k = 0; k < radix; ++k) {
+                const double theta = (2*M_PI*k)/radix;
+                stage.rot_re[k] =  cos(theta);
+                stage.rot_im[k] = -sin(theta);
+            }
+        }
+
+        plan.stages.push_back(std::move(stage));
+
+        len /= radix;
+        s   *= radix;
     }
+
+    if (plan.packed) {
+        plan.post_re.resize(plan.m + 1);
+        plan.post_im.resize(plan.m + 1);
+        for (int k = 0; k <= plan.m; ++k) {
+            const double theta = (2*M_PI*k)/n;
+            plan.post_re[k] =  cos(theta);
+            plan.post_im[k] = -sin(theta);
+        }
+    }
+
+    return plan;
 }
 
-// Cooley-Tukey FFT
-// poor man's implementation - use something better
-// input is real-valued
-// output is complex-valued
-static void fft(const std::vector<float> & in, std::vector<float> & out) {
-    out.resize(in.size()*2);
+// plans are built once per frame size; the sizes used by whisper don't need the lock
+static const whisper_rfft_plan & whisper_rfft_plan_get(int n) {
+    static const whisper_rfft_plan plan_n_fft   = whisper_rfft_plan_init(WHISPER_N_FFT);
+    static const whisper_rfft_plan plan_n_fft_2 = whisper_rfft_plan_init(2*WHISPER_N_FFT);
 
-    int N = in.size();
+    if (n == WHISPER_N_FFT) {
+        return plan_n_fft;
+    }
+    if (n == 2*WHISPER_N_FFT) {
+        return plan_n_fft_2;
+    }
 
-    if (N == 1) {
-        out[0] = in[0];
-        out[1] = 0;
-        return;
+    static std::mutex mutex;
+    static std::map<int, std::unique_ptr<whisper_rfft_plan>> plans;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    auto & plan = plans[n];
+    if (!plan) {
+        plan.reset(new whisper_rfft_plan(whisper_rfft_plan_init(n)));
     }
+    return *plan;
+}
 
-    if (N%2 == 1) {
-        dft(in, out);
-        return;
+// float lanes processed together by the FFT butterflies: a SIMD register, or a single float for the tail
+#if defined(__AVX__)
+struct whisper_fft_simd {
+    static constexpr int width = 8;
+    __m256 v;
+
+    static whisper_fft_simd load(const float * p) { return { _mm256_loadu_ps(p) }; }
+    static whisper_fft_simd set1(float x)         { return { _mm256_set1_ps(x) }; }
+    void store(float * p) const                   { _mm256_storeu_ps(p, v); }
+
+    whisper_fft_simd operator+(whisper_fft_simd b) const { return { _mm256_add_ps(v, b.v) }; }
+    whisper_fft_simd operator-(whisper_fft_simd b) const { return { _mm256_sub_ps(v, b.v) }; }
+    whisper_fft_simd operator*(whisper_fft_simd b) const { return { _mm256_mul_ps(v, b.v) }; }
+};
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+struct whisper_fft_simd {
+    static constexpr int width = 4;
+    __m128 v;
+
+    static whisper_fft_simd load(const float * p) { return { _mm_loadu_ps(p) }; }
+    static whisper_fft_simd set1(float x)         { return { _mm_set1_ps(x) }; }
+    void store(float * p) const                   { _mm_storeu_ps(p, v); }
+
+    whisper_fft_simd operator+(whisper_fft_simd b) const { return { _mm_add_ps(v, b.v) }; }
+    whisper_fft_simd operator-(whisper_fft_simd b) const { return { _mm_sub_ps(v, b.v) }; }
+    whisper_fft_simd operator*(whisper_fft_simd b) const { return { _mm_mul_ps(v, b.v) }; }
+};
+#elif defined(__ARM_NEON)
+struct whisper_fft_simd {
+    static constexpr int width = 4;
+    float32x4_t v;
+
+    static whisper_fft_simd load(const float * p) { return { vld1q_f32(p) }; }
+    static whisper_fft_simd set1(float x)         { return { vdupq_n_f32(x) }; }
+    void store(float * p) const                   { vst1q_f32(p, v); }
+
+    whisper_fft_simd operator+(whisper_fft_simd b) const { return { vaddq_f32(v, b.v) }; }
+    whisper_fft_simd operator-(whisper_fft_simd b) const { return { vsubq_f32(v, b.v) }; }
+    whisper_fft_simd operator*(whisper_fft_simd b) const { return { vmulq_f32(v, b.v) }; }
+};
+#endif
+
+struct whisper_fft_scalar {
+    static constexpr int width = 1;
+    float v;
+
+    static whisper_fft_scalar load(const float * p) { return { *p }; }
+    static whisper_fft_scalar set1(float x)         { return { x }; }
+    void store(float * p) const                     { *p = v; }
+
+    whisper_fft_scalar operator+(whisper_fft_scalar b) const { return { v + b.v }; }
+    whisper_fft_scalar operator-(whisper_fft_scalar b) const { return { v - b.v }; }
+    whisper_fft_scalar operator*(whisper_fft_scalar b) const { return { v * b.v }; }
+};
+
+// y = b*w, stored at y[q]
+template <typename V>
+static inline void whisper_fft_store_twiddled(V br, V bi, float wr, float wi, float * yr, float * yi, int q) {
+    const V w_r = V::set1(wr);
+    const V w_i = V::set1(wi);
+
+    (br*w_r - bi*w_i).store(yr + q);
+    (br*w_i + bi*w_r).store(yi + q);
+}
+
+// one Stockham pass over the lanes [q0, q1) of every sub-transform: reads x, writes y
+template <typename V>
+static void whisper_cfft_stage_lanes(const whisper_rfft_stage & stage,
+        const float * xr, const float * xi, float * yr, float * yi, int q0, int q1) {
+    const int r = stage.radix;
+    const int n = stage.n;
+    const int s = stage.s;
+    const int m = n/r;
+
+    switch (r) {
+        case 2:
+            for (int p = 0; p < m; ++p) {
+                const float * x0r = xr + s*p;     const float * x0i = xi + s*p;
+                const float * x1r = xr + s*(p+m); const float * x1i = xi + s*(p+m);
+
+                float * y0r = yr + s*(2*p + 0); float * y0i = yi + s*(2*p + 0);
+                float * y1r = yr + s*(2*p + 1); float * y1i = yi + s*(2*p + 1);
+
+                for (int q = q0; q < q1; q += V::width) {
+                    const V a0r = V::load(x0r + q); const V a0i = V::load(x0i + q);
+                    const V a1r = V::load(x1r + q); const V a1i = V::load(x1i + q);
+
+                    (a0r + a1r).store(y0r + q);
+                    (a0i + a1i).store(y0i + q);
+                    whisper_fft_store_twiddled(a0r - a1r, a0i - a1i, stage.tw_re[p], stage.tw_im[p], y1r, y1i, q);
+                }
+            }
+            break;
+        case 3:
+            {
+                const V c  = V::set1(-0.5f);               // cos(2*pi/3)
+                const V s1 = V::set1(0.866025403784439f);  // sin(2*pi/3)
+
+                for (int p = 0; p < m; ++p) {
+                    const float * x0r = xr + s*(p + 0*m); const float * x0i = xi + s*(p + 0*m);
+                    const float * x1r = xr + s*(p + 1*m); const float * x1i = xi + s*(p + 1*m);
+                    const float * x2r = xr + s*(p + 2*m); const float * x2i = xi + s*(p + 2*m);
+
+                    float * y0r = yr + s*(3*p + 0); float * y0i = yi + s*(3*p + 0);
+                    float * y1r = yr + s*(3*p + 1); float * y1i = yi + s*(3*p + 1);
+                    float * y2r = yr + s*(3*p + 2); float * y2i = yi + s*(3*p + 2);
+
+                    for (int q = q0; q < q1; q += V::width) {
+                        const V a0r = V::load(x0r + q); const V a0i = V::load(x0i + q);
+                        const V a1r = V::load(x1r + q); const V a1i = V::load(x1i + q);
+                        const V a2r = V::load(x2r + q); const V a2i = V::load(x2i + q);
+
+                        const V t1r = a1r + a2r; const V t1i = a1i + a2i;
+                        const V t2r = a1r - a2r; const V t2i = a1i - a2i;
+
+                        const V ur = a0r + c*t1r; const V ui = a0i + c*t1i;
+                        // v = -i*sin(2*pi/3)*t2
+                        const V vr = s1*t2i; const V vi = V::set1(0.0f) - s1*t2r;
+
+                        (a0r + t1r).store(y0r + q);
+                        (a0i + t1i).store(y0i + q);
+                        whisper_fft_store_twiddled(ur + vr, ui + vi, stage.tw_re[2*p + 0], stage.tw_im[2*p + 0], y1r, y1i, q);
+                        whisper_fft_store_twiddled(ur - vr, ui - vi, stage.tw_re[2*p + 1], stage.tw_im[2*p + 1], y2r, y2i, q);
+                    }
+                }
+            }
+            break;
+        case 4:
+            for (int p = 0; p < m; ++p) {
+                const float * x0r = xr + s*(p + 0*m); const float * x0i = xi + s*(p + 0*m);
+                const float * x1r = xr + s*(p + 1*m); const float * x1i = xi + s*(p + 1*m);
+                const float * x2r = xr + s*(p + 2*m); const float * x2i = xi + s*(p + 2*m);
+                const float * x3r = xr + s*(p + 3*m); const float * x3i = xi + s*(p + 3*m);
+
+                float * y0r = yr + s*(4*p + 0); float * y0i = yi + s*(4*p + 0);
+                float * y1r = yr + s*(4*p + 1); float * y1i = yi + s*(4*p + 1);
+                float * y2r = yr + s*(4*p + 2); float * y2i = yi + s*(4*p + 2);
+                float * y3r = yr + s*(4*p + 3); float * y3i = yi + s*(4*p + 3);
+
+                for (int q = q0; q < q1; q += V::width) {
+                    const V a0r = V::load(x0r + q); const V a0i = V::load(x0i + q);
+                    const V a1r = V::load(x1r + q); const V a1i = V::load(x1i + q);
+                    const V a2r = V::load(x2r + q); const V a2i = V::load(x2i + q);
+                    const V a3r = V::load(x3r + q); const V a3i = V::load(x3i + q);
+
+                    const V t0r = a0r + a2r; const V t0i = a0i + a2i;
+                    const V t1r = a0r - a2r; const V t1i = a0i - a2i;
+                    const V t2r = a1r + a3r; const V t2i = a1i + a3i;
+                    // -i*(x1 - x3)
+                    const V t3r = a1i - a3i; const V t3i = a3r - a1r;
+
+                    (t0r + t2r).store(y0r + q);
+                    (t0i + t2i).store(y0i + q);
+                    whisper_fft_store_twiddled(t1r + t3r, t1i + t3i, stage.tw_re[3*p + 0], stage.tw_im[3*p + 0], y1r, y1i, q);
+                    whisper_fft_store_twiddled(t0r - t2r, t0i - t2i, stage.tw_re[3*p + 1], stage.tw_im[3*p + 1], y2r, y2i, q);
+                    whisper_fft_store_twiddled(t1r - t3r, t1i - t3i, stage.tw_re[3*p + 2], stage.tw_im[3*p + 2], y3r, y3i, q);
+                }
+            }
+            break;
+        case 5:
+            {
+                const V c1 = V::set1( 0.309016994374947f); // cos(2*pi/5)
+                const V c2 = V::set1(-0.809016994374947f); // cos(4*pi/5)
+                const V s1 = V::set1( 0.951056516295154f); // sin(2*pi/5)
+                const V s2 = V::set1( 0.587785252292473f); // sin(4*pi/5)
+
+                for (int p = 0; p < m; ++p) {
+                    const float * x0r = xr + s*(p + 0*m); const float * x0i = xi + s*(p + 0*m);
+                    const float * x1r = xr + s*(p + 1*m); const float * x1i = xi + s*(p + 1*m);
+                    const float * x2r = xr + s*(p + 2*m); const float * x2i = xi + s*(p + 2*m);
+                    const float * x3r = xr + s*(p + 3*m); const float * x3i = xi + s*(p + 3*m);
+                    const float * x4r = xr + s*(p + 4*m); const float * x4i = xi + s*(p + 4*m);
+
+                    float * y0r = yr + s*(5*p + 0); float * y0i = yi + s*(5*p + 0);
+                    float * y1r = yr + s*(5*p + 1); float * y1i = yi + s*(5*p + 1);
+                    float * y2r = yr + s*(5*p + 2); float * y2i = yi + s*(5*p + 2);
+                    float * y3r = yr + s*(5*p + 3); float * y3i = yi + s*(5*p + 3);
+                    float * y4r = yr + s*(5*p + 4); float * y4i = yi + s*(5*p + 4);
+
+                    for (int q = q0; q < q1; q += V::width) {
+                        const V a0r = V::load(x0r + q); const V a0i = V::load(x0i + q);
+                        const V a1r = V::load(x1r + q); const V a1i = V::load(x1i + q);
+                        const V a2r = V::load(x2r + q); const V a2i = V::load(x2i + q);
+                        const V a3r = V::load(x3r + q); const V a3i = V::load(x3i + q);
+                        const V a4r = V::load(x4r + q); const V a4i = V::load(x4i + q);
+
+                        const V t1r = a1r + a4r; const V t1i = a1i + a4i;
+                        const V t2r = a2r + a3r; const V t2i = a2i + a3i;
+                        const V t3r = a1r - a4r; const V t3i = a1i - a4i;
+                        const V t4r = a2r - a3r; const V t4i = a2i - a3i;
+
+                        const V u1r = a0r + c1*t1r + c2*t2r; const V u1i = a0i + c1*t1i + c2*t2i;
+                        const V u2r = a0r + c2*t1r + c1*t2r; const V u2i = a0i + c2*t1i + c1*t2i;
+
+                        // v = s1*t3 + s2*t4, z = s2*t3 - s1*t4, multiplied by -i below
+                        const V vr = s1*t3r + s2*t4r; const V vi = s1*t3i + s2*t4i;
+                        const V zr = s2*t3r - s1*t4r; const V zi = s2*t3i - s1*t4i;
+
+                        (a0r + t1r + t2r).store(y0r + q);
+                        (a0i + t1i + t2i).store(y0i + q);
+                        whisper_fft_store_twiddled(u1r + vi, u1i - vr, stage.tw_re[4*p + 0], stage.tw_im[4*p + 0], y1r, y1i, q);
+                        whisper_fft_store_twiddled(u2r + zi, u2i - zr, stage.tw_re[4*p + 1], stage.tw_im[4*p + 1], y2r, y2i, q);
+                        whisper_fft_store_twiddled(u2r - zi, u2i + zr, stage.tw_re[4*p + 2], stage.tw_im[4*p + 2], y3r, y3i, q);
+                        whisper_fft_store_twiddled(u1r - vi, u1i + vr, stage.tw_re[4*p + 3], stage.tw_im[4*p + 3], y4r, y4i, q);
+                    }
+                }
+            }
+            break;
+        default:
+            // any other prime: direct DFT of the radix points
+            for (int p = 0; p < m; ++p) {
+                for (int k = 0; k < r; ++k) {
+                    float * ykr = yr + s*(r*p + k);
+                    float * yki = yi + s*(r*p + k);
+
+                    for (int q = q0; q < q1; q += V::width) {
+                        V accr = V::set1(0.0f);
+                        V acci = V::set1(0.0f);
+                        for (int j = 0; j < r; ++j) {
+                            const V ajr = V::load(xr + s*(p + j*m) + q);
+                            const V aji = V::load(xi + s*(p + j*m) + q);
+                            const V wr  = V::set1(stage.rot_re[(j*k) % r]);
+                            const V wi  = V::set1(stage.rot_im[(j*k) % r]);
+
+                            accr = accr + ajr*wr - aji*wi;
+                            acci = acci + ajr*wi + aji*wr;
+                        }
+
+                        if (k == 0) {
+                            accr.store(ykr + q);
+                            acci.store(yki + q);
+                        } else {
+                            whisper_fft_store_twiddled(accr, acci, stage.tw_re[(r - 1)*p + k - 1], stage.tw_im[(r - 1)*p + k - 1], ykr, yki, q);
+                        }
+                    }
+                }
+            }
+            break;
+    }
+}
+
+// one Stockham pass: reads x, writes y; the stride is processed with SIMD, the rest of it with scalars
+static void whisper_cfft_stage(const whisper_rfft_stage & stage,
+        const float * xr, const float * xi, float * yr, float * yi) {
+    int q_simd = 0;
+#if defined(__AVX__) || defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || defined(__ARM_NEON)
+    q_simd = stage.s - stage.s % whisper_fft_simd::width;
+    if (q_simd > 0) {
+        whisper_cfft_stage_lanes<whisper_fft_simd>(stage, xr, xi, yr, yi, 0, q_simd);
+    }
+#endif
+    if (q_simd < stage.s) {
+        whisper_cfft_stage_lanes<whisper_fft_scalar>(stage, xr, xi, yr, yi, q_simd, stage.s);
     }
+}
 
-    std::vector<float> even;
-    std::vector<float> odd;
+// power spectrum |X[k]|^2, k in [0, n/2], of the real sequence in[0..n)
+// work must hold plan.n_work floats
+static void whisper_rfft_power(const whisper_rfft_plan & plan, const float * in, float * work, float * out) {
+    const int m = plan.m;
 
-    even.reserve(N/2);
-    odd.reserve(N/2);
+    float * ar = work + 0*m;
+    float * ai = work + 1*m;
+    float * br = work + 2*m;
+    float * bi = work + 3*m;
 
-    for (int i = 0; i < N; i++) {
-        if (i % 2 == 0) {
-            even.push_back(in[i]);
-        } else {
-            odd.push_back(in[i]);
+    if (plan.packed) {
+        for (int j = 0; j < m; ++j) {
+            ar[j] = in[2*j + 0];
+            ai[j] = in[2*j + 1];
+        }
+    } else {
+        for (int j = 0; j < m; ++j) {
+            ar[j] = in[j];
+            ai[j] = 0.0f;
         }
     }
 
-    std::vector<float> even_fft;
-    std::vector<float> odd_fft;
+    for (const auto & stage : plan.stages) {
+        whisper_cfft_stage(stage, ar, ai, br, bi);
+        std::swap(ar, br);
+        std::swap(ai, bi);
+    }
+
+    if (!plan.packed) {
+        for (int k = 0; k <= plan.n/2; ++k) {
+            out[k] = ar[k]*ar[k] + ai[k]*ai[k];
+        }
+        return;
+    }
+
+    // X[k] = E[k] + W^k O[k], where E and O are the spectra of the even and odd samples:
+    // E[k] = (Z[k] + conj(Z[m-k]))/2, O[k] = -i*(Z[k] - conj(Z[m-k]))/2
+    for (int k = 0; k <= m; ++k) {
+        const int k0 = k == m ? 0 : k;
+        const int k1 = k == 0 ? 0 : m - k;
 
-    fft(even, even_fft);
-    fft(odd, odd_fft);
+        const float zr = ar[k0]; const float zi = ai[k0];
+        const float cr = ar[k1]; const float ci = -ai[k1];
 
-    const int sin_cos_step = SIN_COS_N_COUNT / N;
-    for (int k = 0; k < N/2; k++) {
-        int idx = k * sin_cos_step; // t = 2*M_PI*k/N
-        float re = cos_vals[idx]; // cos(t)
-        float im = -sin_vals[idx]; // sin(t)
+        const float e_re =  0.5f*(zr + cr);
+        const float e_im =  0.5f*(zi + ci);
+        const float o_re =  0.5f*(zi - ci);
+        const float o_im = -0.5f*(zr - cr);
 
-        float re_odd = odd_fft[2*k + 0];
-        float im_odd = odd_fft[2*k + 1];
+        const float wr = plan.post_re[k];
+        const float wi = plan.post_im[k];
 
-        out[2*k + 0] = even_fft[2*k + 0] + re*re_odd - im*im_odd;
-        out[2*k + 1] = even_fft[2*k + 1] + re*im_odd + im*re_odd;
+        const float xr = e_re + o_re*wr - o_im*wi;
+        const float xi = e_im + o_re*wi + o_im*wr;
 
-        out[2*(k + N/2) + 0] = even_fft[2*k + 0] - re*re_odd + im*im_odd;
-        out[2*(k + N/2) + 1] = even_fft[2*k + 1] - re*im_odd - im*re_odd;
+        out[k] = xr*xr + xi*xi;
     }
 }
 
@@ -2780,13 +3664,84 @@ static bool hann_window(int length, bool periodic, std::vector<float> & output)
     return true;
 }
 
+// sum of x[k]*y[k], accumulated in float
+static float whisper_vec_dot_f32(int n, const float * x, const float * y) {
+    int k = 0;
+    float sum = 0.0f;
+
+#if defined(__AVX__)
+    __m256 acc = _mm256_setzero_ps();
+    for (; k + 8 <= n; k += 8) {
+        acc = _mm256_add_ps(acc, _mm256_mul_ps(_mm256_loadu_ps(x + k), _mm256_loadu_ps(y + k)));
+    }
+    __m128 acc4 = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+    acc4 = _mm_add_ps(acc4, _mm_movehl_ps(acc4, acc4));
+    acc4 = _mm_add_ss(acc4, _mm_shuffle_ps(acc4, acc4, 1));
+    sum = _mm_cvtss_f32(acc4);
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    __m128 acc = _mm_setzero_ps();
+    for (; k + 4 <= n; k += 4) {
+        acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(x + k), _mm_loadu_ps(y + k)));
+    }
+    acc = _mm_add_ps(acc, _mm_movehl_ps(acc, acc));
+    acc = _mm_add_ss(acc, _mm_shuffle_ps(acc, acc, 1));
+    sum = _mm_cvtss_f32(acc);
+#elif defined(__ARM_NEON)
+    float32x4_t acc = vdupq_n_f32(0.0f);
+    for (; k + 4 <= n; k += 4) {
+        acc = vmlaq_f32(acc, vld1q_f32(x + k), vld1q_f32(y + k));
+    }
+    sum = vgetq_lane_f32(acc, 0) + vgetq_lane_f32(acc, 1) + vgetq_lane_f32(acc, 2) + vgetq_lane_f32(acc, 3);
+#endif
+
+    for (; k < n; ++k) {
+        sum += x[k]*y[k];
+    }
+
+    return sum;
+}
+
+// apply the mel filterbank to the power spectrum of frame i
+static void log_mel_filterbank(const float * fft_out, int n_fft, int i, const whisper_filters & filters, whisper_mel & mel) {
+#ifdef WHISPER_MEL_FILTERS_REFERENCE
+    // dense reference path
+    for (int j = 0; j < mel.n_mel; j++) {
+        double sum = 0.0;
+
+        for (int k = 0; k < n_fft; k++) {
+            sum += fft_out[k] * filters.data[j * filters.n_fft + k];
+        }
+
+        sum = log10(std::max(sum, 1e-10));
+
+        mel.data[j * mel.n_len + i] = sum;
+    }
+#else
+    // only the non-zero part of every filter
+    for (int j = 0; j < mel.n_mel; j++) {
+        const int k0 = filters.start[j];
+        const int k1 = std::min(k0 + filters.len[j], n_fft);
+
+        double sum = k1 > k0 ? whisper_vec_dot_f32(k1 - k0, fft_out + k0, filters.data.data() + j * filters.n_fft + k0) : 0.0;
+
+        sum = log10(std::max(sum, 1e-10));
+
+        mel.data[j * mel.n_len + i] = sum;
+    }
+#endif
+}
+
 static void log_mel_spectrogram_worker_thread(int ith, const std::vector<float> & hann, const std::vector<float> & samples,
                                               int n_samples, int frame_size, int frame_step, int n_threads,
                                               const whisper_filters & filters, whisper_mel & mel) {
+    const whisper_rfft_plan & plan = whisper_rfft_plan_get(frame_size);
+
+    // scratch buffers are allocated once per thread, the FFT itself does not allocate
     std::vector<float> fft_in(frame_size, 0.0);
-    std::vector<float> fft_out(2 * frame_step);
+    std::vector<float> fft_work(plan.n_work);
     // make sure n_fft == 1 + (WHISPER_N_FFT / 2), bin_0 to bin_nyquist
     int n_fft = 1 + (frame_size / 2);
+    std::vector<float> fft_out(n_fft);
     int i = ith;
 
     // calculate FFT only when fft_in are not all zero
@@ -2802,46 +3757,39 @@ static void log_mel_spectrogram_worker_thread(int ith, const std::vector<float>
             std::fill(fft_in.begin() + (n_samples - offset), fft_in.end(), 0.0);
         }
 
-        // FFT
-        fft(fft_in, fft_out);
-
-        // Calculate modulus^2 of complex numbers
-        // Use pow(fft_out[2 * j + 0], 2) + pow(fft_out[2 * j + 1], 2) causes inference quality problem? Interesting.
-        for (int j = 0; j < frame_size; j++) {
-            fft_out[j] = (fft_out[2 * j + 0] * fft_out[2 * j + 0] + fft_out[2 * j + 1] * fft_out[2 * j + 1]);
-        }
+        // FFT + modulus^2 of the complex bins
+        whisper_rfft_power(plan, fft_in.data(), fft_work.data(), fft_out.data());
 
         // mel spectrogram
-        for (int j = 0; j < mel.n_mel; j++) {
-            double sum = 0.0;
-
-            // unroll loop (suggested by GH user @lunixbochs)
-            int k = 0;
-            for (k = 0; k < n_fft - 3; k += 4) {
-                sum +=
-                        fft_out[k + 0] * filters.data[j * n_fft + k + 0] +
-                        fft_out[k + 1] * filters.data[j * n_fft + k + 1] +
-                        fft_out[k + 2] * filters.data[j * n_fft + k + 2] +
-                        fft_out[k + 3] * filters.data[j * n_fft + k + 3];
-            }
-
-            // handle n_fft remainder
-            for (; k < n_fft; k++) {
-                sum += fft_out[k] * filters.data[j * n_fft + k];
-            }
+        log_mel_filterbank(fft_out.data(), std::min(n_fft, filters.n_fft), i, filters, mel);
+    }
 
-            sum = log10(std::max(sum, 1e-10));
+    // Otherwise fft_out are all zero
+    double sum = log10(1e-10);
+    for (; i < mel.n_len; i += n_threads) {
+        for (int j = 0; j < mel.n_mel; j++) {
+            mel.data[j * mel.n_len + i] = sum;
+        }
+    }
+}
 
-            mel.data[j * mel.n_len + i] = sum;
+// clamping and normalization of the log10 mel values
+static void log_mel_normalize(whisper_mel & mel) {
+    double mmax = -1e20;
+    for (int i = 0; i < mel.n_mel*mel.n_len; i++) {
+        if (mel.data[i] > mmax) {
+            mmax = mel.data[i];
         }
     }
 
-    // Otherwise fft_out are all zero
-    double sum = log10(1e-10);
-    for (; i < mel.n_len; i += n_threads) {
-        for (int j = 0; j < mel.n_mel; j++) {
-            mel.data[j * mel.n_len + i] = sum;
+    mmax -= 8.0;
+
+    for (int i = 0; i < mel.n_mel*mel.n_len; i++) {
+        if (mel.data[i] < mmax) {
+            mel.data[i] = mmax;
         }
+
+        mel.data[i] = (mel.data[i] + 4.0)/4.0;
     }
 }
 
@@ -2871,21 +3819,19 @@ static bool log_mel_spectrogram(
     int64_t stage_1_pad = WHISPER_SAMPLE_RATE * 30;
     int64_t stage_2_pad = frame_size / 2;
 
-    // Initialize a vector and copy data from C array to it.
-    std::vector<float> samples_padded;
-    samples_padded.resize(n_samples + stage_1_pad + stage_2_pad * 2);
+    // The audio is conceptually padded with 30 seconds of zeros (480,000 samples) + 200 zeros at the end.
+    // Only the frames overlapping the audio are computed, the frames after it are all zero and the worker
+    // threads fill them with a constant, so the zero padding itself is never materialized.
+    std::vector<float> samples_padded(n_samples + 2 * stage_2_pad, 0.0f);
     std::copy(samples, samples + n_samples, samples_padded.begin() + stage_2_pad);
 
-    // pad 30 seconds of zeros at the end of audio (480,000 samples) + reflective pad 200 samples at the end of audio
-    std::fill(samples_padded.begin() + n_samples + stage_2_pad, samples_padded.begin() + n_samples + stage_1_pad + 2 * stage_2_pad, 0);
-
     // reflective pad 200 samples at the beginning of audio
     std::reverse_copy(samples + 1, samples + 1 + stage_2_pad, samples_padded.begin());
 
     mel.n_mel     = n_mel;
     // https://github.com/pytorch/pytorch/blob/main/aten/src/ATen/native/SpectralOps.cpp#L936
     // Calculate number of frames + remove the last frame
-    mel.n_len     = (samples_padded.size() - frame_size) / frame_step;
+    mel.n_len     = (n_samples + stage_1_pad + 2 * stage_2_pad - frame_size) / frame_step;
     // Calculate semi-padded sample length to ensure compatibility
     mel.n_len_org = 1 + (n_samples + stage_2_pad - frame_size) / frame_step;
     mel.data.resize(mel.n_mel * mel.n_len);
@@ -2894,8 +3840,9 @@ static bool log_mel_spectrogram(
     {
         std::vector<std::thread> workers(n_threads - 1);
         for (int iw = 0; iw < n_threads - 1; ++iw) {
+            // the samples are shared read-only by all threads
             workers[iw] = std::thread(
-                    log_mel_spectrogram_worker_thread, iw + 1, std::cref(hann), samples_padded,
+                    log_mel_spectrogram_worker_thread, iw + 1, std::cref(hann), std::cref(samples_padded),
                     n_samples + stage_2_pad, frame_size, frame_step, n_threads,
                     std::cref(filters), std::ref(mel));
         }
@@ -2908,23 +3855,7 @@ static bool log_mel_spectrogram(
         }
     }
 
-    // clamping and normalization
-    double mmax = -1e20;
-    for (int i = 0; i < mel.n_mel*mel.n_len; i++) {
-        if (mel.data[i] > mmax) {
-            mmax = mel.data[i];
-        }
-    }
-
-    mmax -= 8.0;
-
-    for (int i = 0; i < mel.n_mel*mel.n_len; i++) {
-        if (mel.data[i] < mmax) {
-            mel.data[i] = mmax;
-        }
-
-        mel.data[i] = (mel.data[i] + 4.0)/4.0;
-    }
+    log_mel_normalize(mel);
 
     wstate.t_mel_us += ggml_time_us() - t_start_us;
 
@@ -2942,6 +3873,160 @@ static bool log_mel_spectrogram(
     return true;
 }
 
+static std::vector<float> get_signal_energy(const float * signal, int n_samples, int n_samples_per_half_window);
+
+//
+// streaming log mel spectrogram
+//
+// Frames are computed as soon as all of their samples have been pushed, with the same centered
+// framing and reflective start pad as log_mel_spectrogram(). The raw log10 values are kept in a
+// ring buffer and normalized only when a window is handed to the encoder, since the normalization
+// depends on the maximum over the whole window.
+//
+
+void whisper_stream_reset(struct whisper_state * state) {
+    auto & st = state->mel_stream;
+
+    st.started    = false;
+    st.pcm.clear();
+    st.pcm_offset = 0;
+    st.n_frames   = 0;
+    st.n_samples  = 0;
+}
+
+int whisper_stream_push_pcm(struct whisper_context * ctx, struct whisper_state * state, const float * samples, int n_samples) {
+    const int64_t t_start_us = ggml_time_us();
+
+    const auto & filters = ctx->model.filters;
+    auto & st = state->mel_stream;
+
+    const int frame_size = WHISPER_N_FFT;
+    const int frame_step = WHISPER_HOP_LENGTH;
+    const int pad        = frame_size / 2;
+    const int n_fft      = 1 + frame_size / 2;
+
+    if (st.ring.n_mel != filters.n_mel) {
+        st.ring.n_mel     = filters.n_mel;
+        st.ring.n_len     = WHISPER_STREAM_N_FRAMES;
+        st.ring.n_len_org = WHISPER_STREAM_N_FRAMES;
+        st.ring.data.assign(st.ring.n_mel * st.ring.n_len, 0.0f);
+        st.ring_pcm.assign(WHISPER_STREAM_N_FRAMES * frame_step, 0.0f);
+
+        hann_window(frame_size, true, st.hann);
+        st.fft_in.resize(frame_size);
+        st.fft_work.resize(whisper_rfft_plan_get(frame_size).n_work);
+        st.fft_out.resize(n_fft);
+    }
+
+    if (n_samples <= 0) {
+        return 0;
+    }
+
+    st.pcm.insert(st.pcm.end(), samples, samples + n_samples);
+
+    for (int i = 0; i < n_samples; i++) {
+        st.ring_pcm[(st.n_samples + i) % st.ring_pcm.size()] = samples[i];
+    }
+    st.n_samples += n_samples;
+
+    // the reflective pad at the beginning needs the first pad + 1 samples
+    if (!st.started) {
+        if ((int) st.pcm.size() <= pad) {
+            return 0;
+        }
+
+        st.pcm.insert(st.pcm.begin(), pad, 0.0f);
+        std::reverse_copy(st.pcm.begin() + pad + 1, st.pcm.begin() + 2 * pad + 1, st.pcm.begin());
+
+        st.started    = true;
+        st.pcm_offset = 0;
+    }
+
+    const whisper_rfft_plan & plan = whisper_rfft_plan_get(frame_size);
+
+    int n_new = 0;
+    while (st.n_frames * frame_step + frame_size <= st.pcm_offset + (int64_t) st.pcm.size()) {
+        const float * frame = st.pcm.data() + (st.n_frames * frame_step - st.pcm_offset);
+
+        for (int j = 0; j < frame_size; j++) {
+            st.fft_in[j] = st.hann[j] * frame[j];
+        }
+
+        whisper_rfft_power(plan, st.fft_in.data(), st.fft_work.data(), st.fft_out.data());
+        log_mel_filterbank(st.fft_out.data(), std::min(n_fft, filters.n_fft), st.n_frames % st.ring.n_len, filters, st.ring);
+
+        st.n_frames++;
+        n_new++;
+    }
+
+    // drop the samples before the next frame
+    const int64_t n_drop = st.n_frames * frame_step - st.pcm_offset;
+    if (n_drop > 0) {
+        st.pcm.erase(st.pcm.begin(), st.pcm.begin() + n_drop);
+        st.pcm_offset += n_drop;
+    }
+
+    state->t_mel_us += ggml_time_us() - t_start_us;
+
+    return n_new;
+}
+
+int64_t whisper_stream_n_frames(struct whisper_state * state) {
+    return state->mel_stream.n_frames;
+}
+
+int whisper_stream_set_mel(struct whisper_context * ctx, struct whisper_state * state, int n_frames) {
+    const auto & st = state->mel_stream;
+
+    const int n_avail = (int) std::min<int64_t>(st.n_frames, WHISPER_STREAM_N_FRAMES);
+    if (n_avail == 0) {
+        WHISPER_LOG_ERROR("%s: no audio has been pushed to the stream\n", __func__);
+        return -1;
+    }
+
+    if (n_frames <= 0 || n_frames > n_avail) {
+        n_frames = n_avail;
+    }
+
+    // the window is followed by 30 seconds of silence, the same as in log_mel_spectrogram()
+    auto & mel = state->mel;
+
+    mel.n_mel     = ctx->model.filters.n_mel;
+    mel.n_len     = n_frames + WHISPER_STREAM_N_FRAMES;
+    mel.n_len_org = n_frames;
+    mel.data.resize(mel.n_mel * mel.n_len);
+
+    const int64_t first = st.n_frames - n_frames;
+    const float silence = log10(1e-10);
+
+    for (int j = 0; j < mel.n_mel; j++) {
+        const float * src = st.ring.data.data() + j * st.ring.n_len;
+        float * dst = mel.data.data() + j * mel.n_len;
+
+        for (int i = 0; i < n_frames; i++) {
+            dst[i] = src[(first + i) % st.ring.n_len];
+        }
+        std::fill(dst + n_frames, dst + mel.n_len, silence);
+    }
+
+    log_mel_normalize(mel);
+
+    // signal energy of the window for the token-level timestamps (see whisper_full_with_state)
+    {
+        const int64_t s0 = first * WHISPER_HOP_LENGTH;
+        const int64_t s1 = std::min<int64_t>(st.n_frames * WHISPER_HOP_LENGTH, st.n_samples);
+
+        std::vector<float> window(std::max<int64_t>(s1 - s0, 0));
+        for (size_t i = 0; i < window.size(); i++) {
+            window[i] = st.ring_pcm[(s0 + i) % st.ring_pcm.size()];
+        }
+
+        state->energy = get_signal_energy(window.data(), window.size(), 32);
+    }
+
+    return n_frames;
+}
+
 // split text into tokens
 //
 // ref: https://github.com/openai/gpt-2/blob/a74da5d99abaaba920de8131d64da2862a8f213b/src/encoder.py#L53
@@ -3055,7 +4140,8 @@ static std::string whisper_openvino_get_path_cache(std::string path_bin) {
 #endif
 
 struct whisper_state * whisper_init_state(whisper_context * ctx) {
-    fill_sin_cos_table();
+    // build the FFT plans now instead of on the first transcription
+    whisper_rfft_plan_get(WHISPER_N_FFT);
 
     whisper_state * state = new whisper_state;
 
@@ -3227,6 +4313,10 @@ int whisper_ctx_init_openvino_encoder(
 struct whisper_context_params whisper_context_default_params() {
     struct whisper_context_params result = {
         /*.use_gpu    =*/ true,
+        /*.use_mmap   =*/ true,
+        /*.quantize_ftype =*/ GGML_FTYPE_UNKNOWN,
+        /*.load_progress_callback =*/ nullptr,
+        /*.load_progress_callback_user_data =*/ nullptr,
     };
     return result;
 }
@@ -3234,6 +4324,31 @@ struct whisper_context_params whisper_context_default_params() {
 struct whisper_context * whisper_init_from_file_with_params_no_state(const char * path_model, struct whisper_context_params params) {
     WHISPER_LOG_INFO("%s: loading model from '%s'\n", __func__, path_model);
 
+    // map the file and use its pages as CPU tensor data: no reading, no copy, shared with other processes
+    auto mapping = std::make_unique<whisper_mmap>();
+    if (params.use_mmap && mapping->open(path_model)) {
+        whisper_memory_reader reader = { (const uint8_t *) mapping->addr, mapping->size, 0 };
+        whisper_model_loader loader = reader.make_loader(true);
+
+        auto ctx = whisper_init_with_params_no_state(&loader, params);
+
+        if (ctx) {
+            ctx->path_model = path_model;
+            // weights quantized on load don't use the mapped file
+            if (ctx->model.mapped) {
+                ctx->model.mapping = std::move(mapping);
+            }
+        }
+
+        return ctx;
+    }
+
+#if WHISPER_USE_MMAP
+    if (params.use_mmap) {
+        WHISPER_LOG_WARN("%s: failed to map '%s', reading it\n", __func__, path_model);
+    }
+#endif
+
     auto fin = std::ifstream(path_model, std::ios::binary);
     if (!fin) {
         WHISPER_LOG_ERROR("%s: failed to open '%s'\n", __func__, path_model);
@@ -3270,38 +4385,22 @@ struct whisper_context * whisper_init_from_file_with_params_no_state(const char
 }
 
 struct whisper_context * whisper_init_from_buffer_with_params_no_state(void * buffer, size_t buffer_size, struct whisper_context_params params) {
-    struct buf_context {
-        uint8_t* buffer;
-        size_t size;
-        size_t current_offset;
-    };
-
-    buf_context ctx = { reinterpret_cast<uint8_t*>(buffer), buffer_size, 0 };
+    whisper_memory_reader reader = { reinterpret_cast<const uint8_t *>(buffer), buffer_size, 0 };
 
     WHISPER_LOG_INFO("%s: loading model from buffer\n", __func__);
 
-    whisper_model_loader loader = {};
-
-    loader.context = &ctx;
-
-    loader.read = [](void * ctx, void * output, size_t read_size) {
-        buf_context * buf = reinterpret_cast<buf_context *>(ctx);
-
-        size_t size_to_copy = buf->current_offset + read_size < buf->size ? read_size : buf->size - buf->current_offset;
+    // the buffer can be released by the caller, so tensor data is copied
+    whisper_model_loader loader = reader.make_loader(false);
 
-        memcpy(output, buf->buffer + buf->current_offset, size_to_copy);
-        buf->current_offset += size_to_copy;
-
-        return size_to_copy;
-    };
+    return whisper_init_with_params_no_state(&loader, params);
+}
 
-    loader.eof = [](void * ctx) {
-        buf_context * buf = reinterpret_cast<buf_context *>(ctx);
+struct whisper_context * whisper_init_from_buffer_in_place_with_params_no_state(const void * buffer, size_t buffer_size, struct whisper_context_params params) {
+    whisper_memory_reader reader = { reinterpret_cast<const uint8_t *>(buffer), buffer_size, 0 };
 
-        return buf->current_offset >= buf->size;
-    };
+    WHISPER_LOG_INFO("%s: loading model from buffer in place\n", __func__);
 
-    loader.close = [](void * /*ctx*/) { };
+    whisper_model_loader loader = reader.make_loader(true);
 
     return whisper_init_with_params_no_state(&loader, params);
 }
@@ -3315,7 +4414,7 @@ struct whisper_context * whisper_init_with_params_no_state(struct whisper_model_
     if (!whisper_model_load(loader, *ctx)) {
         loader->close(loader->context);
         WHISPER_LOG_ERROR("%s: failed to load model\n", __func__);
-        delete ctx;
+        whisper_free(ctx);
         return nullptr;
     }
 
@@ -3422,6 +4521,8 @@ void whisper_free_state(struct whisper_state * state)
 
         ggml_backend_free(state->backend);
 
+        ggml_threadpool_free(state->threadpool);
+
         delete state;
     }
 }
@@ -3755,6 +4856,111 @@ int whisper_model_type(struct whisper_context * ctx) {
     return ctx->model.type;
 }
 
+bool whisper_model_is_quantized_on_load(struct whisper_context * ctx) {
+    return ctx->model.quantized;
+}
+
+void whisper_encoder_cache_set_size(struct whisper_context * ctx, size_t max_size) {
+    auto & cache = ctx->encoder_cache;
+
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    cache.max_size = max_size;
+    cache.evict(max_size);
+}
+
+bool whisper_model_save(struct whisper_context * ctx, const char * path_model) {
+#if defined(GGML_BIG_ENDIAN)
+    WHISPER_LOG_ERROR("%s: not supported on big endian platforms\n", __func__);
+    return false;
+#endif
+
+    const auto & model   = ctx->model;
+    const auto & hparams = model.hparams;
+    const auto & vocab   = ctx->vocab;
+
+    // write to a temporary file first, so an interrupted save never leaves a broken model behind
+    const std::string path_tmp = std::string(path_model) + ".tmp";
+
+    {
+        std::ofstream fout(path_tmp, std::ios::binary);
+        if (!fout) {
+            WHISPER_LOG_ERROR("%s: failed to open '%s' for writing\n", __func__, path_tmp.c_str());
+            return false;
+        }
+
+        auto write = [&fout](const void * data, size_t size) {
+            fout.write((const char *) data, size);
+        };
+        auto write_i32 = [&write](int32_t value) {
+            write(&value, sizeof(value));
+        };
+
+        write_i32(GGML_FILE_MAGIC);
+
+        write_i32(hparams.n_vocab);
+        write_i32(hparams.n_audio_ctx);
+        write_i32(hparams.n_audio_state);
+        write_i32(hparams.n_audio_head);
+        write_i32(hparams.n_audio_layer);
+        write_i32(hparams.n_text_ctx);
+        write_i32(hparams.n_text_state);
+        write_i32(hparams.n_text_head);
+        write_i32(hparams.n_text_layer);
+        write_i32(hparams.n_mels);
+        write_i32(hparams.ftype + (ggml_is_quantized(ctx->wtype) ? GGML_QNT_VERSION*GGML_QNT_VERSION_FACTOR : 0));
+
+        write_i32(model.filters.n_mel);
+        write_i32(model.filters.n_fft);
+        write(model.filters.data.data(), model.filters.data.size()*sizeof(float));
+
+        write_i32(vocab.n_vocab_file);
+        for (int i = 0; i < vocab.n_vocab_file; ++i) {
+            const auto it = vocab.id_to_token.find(i);
+            const std::string word = it != vocab.id_to_token.end() ? it->second : std::string();
+
+            write_i32((int32_t) word.size());
+            write(word.data(), word.size());
+        }
+
+        std::vector<char> data;
+
+        for (const auto & t : model.tensors) {
+            const ggml_tensor * tensor = t.second;
+            const int32_t n_dims = ggml_n_dims(tensor);
+
+            write_i32(n_dims);
+            write_i32((int32_t) t.first.size());
+            write_i32((int32_t) tensor->type);
+            for (int i = 0; i < n_dims; ++i) {
+                write_i32((int32_t) tensor->ne[i]);
+            }
+            write(t.first.data(), t.first.size());
+
+            data.resize(ggml_nbytes(tensor));
+            ggml_backend_tensor_get(tensor, data.data(), 0, data.size());
+            write(data.data(), data.size());
+        }
+
+        if (!fout) {
+            WHISPER_LOG_ERROR("%s: failed to write '%s'\n", __func__, path_tmp.c_str());
+            fout.close();
+            std::remove(path_tmp.c_str());
+            return false;
+        }
+    }
+
+    std::remove(path_model);
+    if (std::rename(path_tmp.c_str(), path_model) != 0) {
+        WHISPER_LOG_ERROR("%s: failed to rename '%s' to '%s'\n", __func__, path_tmp.c_str(), path_model);
+        std::remove(path_tmp.c_str());
+        return false;
+    }
+
+    WHISPER_LOG_INFO("%s: saved model to '%s'\n", __func__, path_model);
+
+    return true;
+}
+
 const char *whisper_model_type_readable(struct whisper_context * ctx) {
     switch (ctx->model.type) {
     case e_model::MODEL_TINY:
@@ -4469,7 +5675,6 @@ struct whisper_full_params whisper_full_default_params(enum whisper_sampling_str
 }
 
 // forward declarations
-static std::vector<float> get_signal_energy(const float * signal, int n_samples, int n_samples_per_half_window);
 static void whisper_exp_compute_token_level_timestamps(
         struct whisper_context & ctx,
           struct whisper_state & state,
@@ -5050,24 +6255,47 @@ int whisper_full_with_state(
         }
     }
 
+    // overwrite audio_ctx, max allowed is hparams.n_audio_ctx
+    if (params.audio_ctx > whisper_n_audio_ctx(ctx)) {
+        WHISPER_LOG_ERROR("%s: audio_ctx is larger than the maximum allowed (%d > %d)\n", __func__, params.audio_ctx, whisper_n_audio_ctx(ctx));
+        return -5;
+    }
+    // language is always detected with the full audio context of the model: reduced context makes detection unreliable
+    state->exp_n_audio_ctx = 0;
+
+    // mel offset of the window which is already encoded (by language detection)
+    int seek_encoded = -1;
+
+    state->lang_prob = 0.0f;
+
     // auto-detect language if not specified
     if (params.language == nullptr || strlen(params.language) == 0 || strcmp(params.language, "auto") == 0 || params.detect_language) {
         std::vector<float> probs(whisper_lang_max_id() + 1, 0.0f);
 
-        const auto lang_id = whisper_lang_auto_detect_with_state(ctx, state, 0, params.n_threads, probs.data());
+        // detect language in the first window which is transcribed
+        const int lang_offset_ms = params.offset_ms/10 < state->mel.n_len_org ? params.offset_ms : 0;
+
+        const auto lang_id = whisper_lang_auto_detect_with_state(ctx, state, lang_offset_ms, params.n_threads, probs.data());
         if (lang_id < 0) {
             WHISPER_LOG_ERROR("%s: failed to auto-detect language\n", __func__);
             return -3;
         }
+        // the encoder pass of language detection is reused for the first window only if the context is the same
+        if (params.audio_ctx == 0 || params.audio_ctx == whisper_n_audio_ctx(ctx)) {
+            seek_encoded = lang_offset_ms/10;
+        }
         state->lang_id = lang_id;
+        state->lang_prob = probs[lang_id];
         params.language = whisper_lang_str(lang_id);
 
-        WHISPER_LOG_INFO("%s: auto-detected language: %s (p = %f)\n", __func__, params.language, probs[whisper_lang_id(params.language)]);
+        WHISPER_LOG_INFO("%s: auto-detected language: %s (p = %f)\n", __func__, params.language, state->lang_prob);
         if (params.detect_language) {
             return 0;
         }
     }
 
+    state->exp_n_audio_ctx = params.audio_ctx;
+
     if (params.token_timestamps) {
         state->t_beg    = 0;
         state->t_last   = 0;
@@ -5162,13 +6390,6 @@ int whisper_full_with_state(
         }
     }
 
-    // overwrite audio_ctx, max allowed is hparams.n_audio_ctx
-    if (params.audio_ctx > whisper_n_audio_ctx(ctx)) {
-        WHISPER_LOG_ERROR("%s: audio_ctx is larger than the maximum allowed (%d > %d)\n", __func__, params.audio_ctx, whisper_n_audio_ctx(ctx));
-        return -5;
-    }
-    state->exp_n_audio_ctx = params.audio_ctx;
-
     // these tokens determine the task that will be performed
     std::vector<whisper_token> prompt_init = { whisper_token_sot(ctx), };
 
@@ -5240,7 +6461,10 @@ int whisper_full_with_state(
         }
 
         // encode audio features starting at offset seek
-        if (!whisper_encode_internal(*ctx, *state, seek, params.n_threads, params.abort_callback, params.abort_callback_user_data)) {
+        // language detection leaves encoder output and cross-attention KV of its window in the state; decoding doesn't change them
+        if (seek == seek_encoded) {
+            seek_encoded = -1;
+        } else if (!whisper_encode_internal(*ctx, *state, seek, params.n_threads, params.abort_callback, params.abort_callback_user_data)) {
             WHISPER_LOG_ERROR("%s: failed to encode\n", __func__);
             return -6;
         }
@@ -6017,6 +7241,10 @@ int whisper_full_lang_id(struct whisper_context * ctx) {
     return ctx->state->lang_id;
 }
 
+float whisper_full_lang_prob_from_state(struct whisper_state * state) {
+    return state->lang_prob;
+}
+
 int64_t whisper_full_get_segment_t0_from_state(struct whisper_state * state, int i_segment) {
     return state->result_all[i_segment].t0;
 }
@@ -6424,12 +7652,18 @@ static std::vector<float> get_signal_energy(const float * signal, int n_samples,
 
     std::vector<float> result(n_samples);
 
+    // running sum of |signal| over [i - hw, i + hw]
+    double sum = 0;
+    for (int j = 0; j < std::min(hw, n_samples); j++) {
+        sum += fabs(signal[j]);
+    }
+
     for (int i = 0; i < n_samples; i++) {
-        float sum = 0;
-        for (int j = -hw; j <= hw; j++) {
-            if (i + j >= 0 && i + j < n_samples) {
-                sum += fabs(signal[i + j]);
-            }
+        if (i + hw < n_samples) {
+            sum += fabs(signal[i + hw]);
+        }
+        if (i - hw - 1 >= 0) {
+            sum -= fabs(signal[i - hw - 1]);
         }
         result[i] = sum/(2*hw + 1);
     }
@@ -6437,6 +7671,152 @@ static std::vector<float> get_signal_energy(const float * signal, int n_samples,
     return result;
 }
 
+struct whisper_vad_params whisper_vad_default_params(void) {
+    struct whisper_vad_params result = {
+        /*.energy_thold   =*/ 12.0f,
+        /*.flux_thold     =*/ 0.35f,
+        /*.energy_min     =*/ -60.0f,
+
+        /*.min_speech_ms  =*/ 100,
+        /*.min_silence_ms =*/ 300,
+        /*.pad_ms         =*/ 150,
+    };
+
+    return result;
+}
+
+int whisper_vad_detect(
+        struct whisper_vad_params   params,
+                      const float * samples,
+                              int   n_samples,
+        struct whisper_vad_region * regions,
+                              int   n_max_regions) {
+    const int frame_size = WHISPER_N_FFT;
+    const int frame_step = WHISPER_HOP_LENGTH;
+    const int n_fft      = 1 + frame_size/2;
+
+    if (n_samples < frame_size) {
+        return 0;
+    }
+
+    const int n_frames = 1 + (n_samples - frame_size)/frame_step;
+
+    // mean amplitude around the center of every frame
+    const std::vector<float> energy = get_signal_energy(samples, n_samples, frame_step/2);
+
+    const whisper_rfft_plan & plan = whisper_rfft_plan_get(frame_size);
+
+    std::vector<float> hann;
+    hann_window(frame_size, true, hann);
+
+    std::vector<float> fft_in(frame_size);
+    std::vector<float> fft_work(plan.n_work);
+    std::vector<float> power(n_fft);
+    std::vector<float> mag_prev(n_fft, 0.0f);
+
+    std::vector<float> energy_db(n_frames);
+    std::vector<float> flux(n_frames, 0.0f);
+
+    for (int i = 0; i < n_frames; i++) {
+        const int offset = i*frame_step;
+
+        energy_db[i] = 20.0f*log10f(std::max(energy[offset + frame_size/2], 1e-10f));
+
+        for (int j = 0; j < frame_size; j++) {
+            fft_in[j] = hann[j]*samples[offset + j];
+        }
+        whisper_rfft_power(plan, fft_in.data(), fft_work.data(), power.data());
+
+        // positive spectral flux, normalized by the magnitude of the frame
+        float sum_pos = 0.0f;
+        float sum_mag = 0.0f;
+        for (int k = 0; k < n_fft; k++) {
+            const float mag = sqrtf(power[k]);
+            sum_pos += std::max(mag - mag_prev[k], 0.0f);
+            sum_mag += mag;
+            mag_prev[k] = mag;
+        }
+        flux[i] = (i > 0 && sum_mag > 0.0f) ? sum_pos/sum_mag : 0.0f;
+    }
+
+    // noise floor: 10th percentile of the frame energies
+    // if there are no pauses in the audio, it's limited to 30 dB below the loudest frame
+    float noise_db = 0.0f;
+    {
+        std::vector<float> sorted = energy_db;
+        std::sort(sorted.begin(), sorted.end());
+        noise_db = std::min(sorted[n_frames/10], sorted.back() - 30.0f);
+    }
+
+    std::vector<bool> voiced(n_frames);
+    for (int i = 0; i < n_frames; i++) {
+        const float e = energy_db[i];
+        voiced[i] = e > params.energy_min &&
+            (e > noise_db + params.energy_thold || (e > noise_db + 0.5f*params.energy_thold && flux[i] > params.flux_thold));
+    }
+
+    // runs of voiced frames, 1 frame = 10 ms
+    const int min_speech  = std::max(params.min_speech_ms, 0)/10;
+    const int min_silence = std::max(params.min_silence_ms, 0)/10;
+    const int64_t pad     = (int64_t) std::max(params.pad_ms, 0)*WHISPER_SAMPLE_RATE/1000;
+
+    std::vector<std::pair<int, int>> runs;
+    for (int i = 0; i < n_frames; ) {
+        if (!voiced[i]) {
+            i++;
+            continue;
+        }
+
+        int j = i;
+        while (j < n_frames && voiced[j]) {
+            j++;
+        }
+
+        if (!runs.empty() && i - runs.back().second < min_silence) {
+            runs.back().second = j;
+        } else {
+            runs.push_back({ i, j });
+        }
+
+        i = j;
+    }
+
+    int n_regions = 0;
+    whisper_vad_region last = { -1, -1 };
+
+    for (const auto & run : runs) {
+        if (run.second - run.first < min_speech) {
+            continue;
+        }
+
+        const int64_t start = std::max<int64_t>(0, (int64_t) run.first*frame_step - pad);
+        const int64_t end   = std::min<int64_t>(n_samples, (int64_t) (run.second - 1)*frame_step + frame_size + pad);
+
+        // padded regions can overlap
+        if (last.end >= 0 && start <= last.end) {
+            last.end = end;
+            continue;
+        }
+
+        if (last.end >= 0) {
+            if (n_regions < n_max_regions) {
+                regions[n_regions] = last;
+            }
+            n_regions++;
+        }
+        last = { start, end };
+    }
+
+    if (last.end >= 0) {
+        if (n_regions < n_max_regions) {
+            regions[n_regions] = last;
+        }
+        n_regions++;
+    }
+
+    return n_regions;
+}
+
 static void whisper_exp_compute_token_level_timestamps(
         struct whisper_context & ctx,
           struct whisper_state & state,
@@ -84,8 +84,20 @@ extern "C" {
     typedef int32_t whisper_token;
     typedef int32_t whisper_seq_id;
 
+    // Model load progress callback
+    // Called after every loaded tensor; return false to abort loading
+    typedef bool (*whisper_load_progress_callback)(size_t bytes_loaded, size_t bytes_total, int tensors_loaded, int tensors_total, void * user_data);
+
     struct whisper_context_params {
         bool  use_gpu;
+        bool  use_mmap; // map model file to memory instead of reading it (whisper_init_from_file_*)
+
+        // quantize F16 weights to this type while loading (GGML_FTYPE_MOSTLY_Q8_0, _Q5_1, _Q4_0, ...)
+        // GGML_FTYPE_UNKNOWN keeps the precision of the model file
+        enum ggml_ftype quantize_ftype;
+
+        whisper_load_progress_callback load_progress_callback;
+        void * load_progress_callback_user_data;
     };
 
     typedef struct whisper_token_data {
@@ -111,6 +123,11 @@ extern "C" {
         size_t (*read)(void * ctx, void * output, size_t read_size);
         bool    (*eof)(void * ctx);
         void  (*close)(void * ctx);
+
+        // optional: return pointer to the next read_size bytes of the model data and skip them.
+        // If set, tensors of the CPU backend point directly into this memory instead of reading into allocated buffers,
+        // so it must be valid and unchanged until the context is freed. Return NULL on failure.
+        void * (*map)(void * ctx, size_t read_size);
     } whisper_model_loader;
 
     // grammar element type
@@ -157,6 +174,10 @@ extern "C" {
     WHISPER_API struct whisper_context * whisper_init_from_buffer_with_params_no_state(void * buffer, size_t buffer_size,    struct whisper_context_params params);
     WHISPER_API struct whisper_context * whisper_init_with_params_no_state            (struct whisper_model_loader * loader, struct whisper_context_params params);
 
+    // Same as whisper_init_from_buffer_with_params_no_state, but CPU backend tensors point directly into the buffer
+    // instead of copying it. The buffer must stay valid and unchanged until the context is freed.
+    WHISPER_API struct whisper_context * whisper_init_from_buffer_in_place_with_params_no_state(const void * buffer, size_t buffer_size, struct whisper_context_params params);
+
     WHISPER_DEPRECATED(
         WHISPER_API struct whisper_context * whisper_init_from_file(const char * path_model),
         "use whisper_init_from_file_with_params instead"
@@ -256,6 +277,32 @@ extern "C" {
                                int   n_len,
                                int   n_mel);
 
+    // Streaming log mel spectrogram
+    // Audio can be pushed to a state in chunks of any size. Only the mel frames of the new samples are computed
+    // and the last 30 seconds of frames are kept in a ring buffer inside the state.
+    // The samples must be PCM float 32-bit, 16 kHz, mono.
+    // Returns the number of new frames
+    WHISPER_API int whisper_stream_push_pcm(
+            struct whisper_context * ctx,
+              struct whisper_state * state,
+                       const float * samples,
+                               int   n_samples);
+
+    // Clear the streamed audio, the next pushed samples start a new stream
+    WHISPER_API void whisper_stream_reset(struct whisper_state * state);
+
+    // Number of mel frames computed since the last reset (100 frames per second)
+    WHISPER_API int64_t whisper_stream_n_frames(struct whisper_state * state);
+
+    // Use the last n_frames of the stream (0 - all available frames, at most 30 seconds) as the log mel spectrogram
+    // of the state, so whisper_encode_with_state() or whisper_full_with_state() with n_samples = 0 can run on it
+    // The signal energy of the window used by the token-level timestamps is updated as well
+    // Returns the number of frames in the window or -1 on failure
+    WHISPER_API int whisper_stream_set_mel(
+            struct whisper_context * ctx,
+              struct whisper_state * state,
+                               int   n_frames);
+
     // Run the Whisper encoder on the log mel spectrogram stored inside the default state in the provided whisper context.
     // Make sure to call whisper_pcm_to_mel() or whisper_set_mel() first.
     // offset can be used to specify the offset of the first frame in the spectrogram.
@@ -357,6 +404,19 @@ extern "C" {
     WHISPER_API int whisper_model_ftype        (struct whisper_context * ctx);
     WHISPER_API int whisper_model_type         (struct whisper_context * ctx);
 
+    // True if weights were quantized while loading the model (see whisper_context_params.quantize_ftype)
+    WHISPER_API bool whisper_model_is_quantized_on_load(struct whisper_context * ctx);
+
+    // Write the loaded model to a file in ggml format, i. e. to cache weights quantized on load
+    // Returns true on success
+    WHISPER_API bool whisper_model_save(struct whisper_context * ctx, const char * path_model);
+
+    // Encoder outputs (embeddings and cross-attention keys and values) of recently encoded audio windows are kept in the context
+    // and shared by all its states, so recognizing the same audio again (i. e. with another language, prompt or
+    // decoding parameters) skips the encoder. Windows are identified by a hash of their mel spectrogram.
+    // max_size: memory budget of the cache in bytes, least recently used windows are evicted; 0 disables the cache (default)
+    WHISPER_API void whisper_encoder_cache_set_size(struct whisper_context * ctx, size_t max_size);
+
     // Token logits obtained from the last call to whisper_decode()
     // The logits for the last token are stored in the last row
     // Rows: n_tokens
@@ -571,6 +631,10 @@ extern "C" {
     // Language id associated with the provided state
     WHISPER_API int whisper_full_lang_id_from_state(struct whisper_state * state);
 
+    // Probability of the language auto-detected by the last whisper_full_with_state() call
+    // Returns 0 if the language was specified in params and wasn't detected
+    WHISPER_API float whisper_full_lang_prob_from_state(struct whisper_state * state);
+
     // Get the start and end time of the specified segment
     WHISPER_API int64_t whisper_full_get_segment_t0           (struct whisper_context * ctx, int i_segment);
     WHISPER_API int64_t whisper_full_get_segment_t0_from_state(struct whisper_state * state, int i_segment);
@@ -608,6 +672,41 @@ extern "C" {
 
     ////////////////////////////////////////////////////////////////////////////
 
+    // Voice activity detection
+    // Finds the regions of the audio which contain speech, based on short-time energy and spectral flux.
+    // Every 10 ms frame is classified relative to the noise floor estimated from the quietest frames of the audio.
+
+    struct whisper_vad_params {
+        float energy_thold;   // [dB] frame is voiced if it's that much louder than the noise floor
+        float flux_thold;     // frame is also voiced if its normalized spectral flux is above this value
+                              // and it's louder than the noise floor by at least energy_thold/2
+        float energy_min;     // [dBFS] frames quieter than this are never voiced
+
+        int   min_speech_ms;  // shorter voiced regions are dropped
+        int   min_silence_ms; // shorter pauses between voiced regions are not split
+        int   pad_ms;         // audio kept before and after every voiced region
+    };
+
+    // voiced region of the audio, in samples
+    struct whisper_vad_region {
+        int64_t start;
+        int64_t end;
+    };
+
+    WHISPER_API struct whisper_vad_params whisper_vad_default_params(void);
+
+    // Find voiced regions of PCM float 32-bit, 16 kHz, mono audio
+    // Up to n_max_regions regions are written to regions, ordered by time and not overlapping
+    // Returns the total number of voiced regions
+    WHISPER_API int whisper_vad_detect(
+            struct whisper_vad_params   params,
+                          const float * samples,
+                                  int   n_samples,
+            struct whisper_vad_region * regions,
+                                  int   n_max_regions);
+
+    ////////////////////////////////////////////////////////////////////////////
+
     // Temporary helpers needed for exposing ggml interface
 
     WHISPER_API int          whisper_bench_memcpy          (int n_threads);
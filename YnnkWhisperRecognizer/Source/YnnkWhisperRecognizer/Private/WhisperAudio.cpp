@@ -0,0 +1,318 @@
+// (c) Yuri N. K. 2024. All rights reserved.
+// ykasczc@gmail.com
+
+#include "WhisperAudio.h"
+
+#if PLATFORM_ENABLE_VECTORINTRINSICS_NEON
+#include <arm_neon.h>
+#define WHISPER_AUDIO_NEON 1
+#elif PLATFORM_ENABLE_VECTORINTRINSICS && PLATFORM_CPU_X86_FAMILY
+#include <emmintrin.h>
+#define WHISPER_AUDIO_SSE 1
+#endif
+
+namespace WhisperAudio
+{
+	/** Zero crossings of the sinc on each side of the filter center (at the lower of two rates) */
+	constexpr int32 ResamplerZeroCrossings = 24;
+
+	/** Filter cutoff relative to the lower Nyquist frequency */
+	constexpr double ResamplerCutoff = 0.92;
+
+	/** Kaiser window shape (~80 dB stopband attenuation) */
+	constexpr double ResamplerKaiserBeta = 8.0;
+
+	static float DotProduct(const float* A, const float* B, int32 Num);
+	static double BesselI0(double X);
+	static TSharedPtr<const FPolyphaseFilterBank, ESPMode::ThreadSafe> CreatePolyphaseFilterBank(int32 InputRate, int32 OutputRate);
+}
+
+void WhisperAudio::ConvertPCM16ToFloat(const int16* InData, int32 NumSamples, float* OutData)
+{
+	// int16 -> [-1, 1)
+	constexpr float Scale = 1.f / 32768.f;
+	int32 Sample = 0;
+
+#if WHISPER_AUDIO_SSE
+	const __m128 VScale = _mm_set1_ps(Scale);
+	for (; Sample + 8 <= NumSamples; Sample += 8)
+	{
+		const __m128i Samples = _mm_loadu_si128((const __m128i*)(InData + Sample));
+		// sign-extend int16 to int32: put sample to the upper half and shift it back
+		const __m128i Lo = _mm_srai_epi32(_mm_unpacklo_epi16(Samples, Samples), 16);
+		const __m128i Hi = _mm_srai_epi32(_mm_unpackhi_epi16(Samples, Samples), 16);
+		_mm_storeu_ps(OutData + Sample, _mm_mul_ps(_mm_cvtepi32_ps(Lo), VScale));
+		_mm_storeu_ps(OutData + Sample + 4, _mm_mul_ps(_mm_cvtepi32_ps(Hi), VScale));
+	}
+#elif WHISPER_AUDIO_NEON
+	const float32x4_t VScale = vdupq_n_f32(Scale);
+	for (; Sample + 8 <= NumSamples; Sample += 8)
+	{
+		const int16x8_t Samples = vld1q_s16(InData + Sample);
+		vst1q_f32(OutData + Sample, vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(Samples))), VScale));
+		vst1q_f32(OutData + Sample + 4, vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(Samples))), VScale));
+	}
+#endif
+	for (; Sample < NumSamples; Sample++)
+	{
+		OutData[Sample] = (float)InData[Sample] * Scale;
+	}
+}
+
+// Num is a multiple of 8
+float WhisperAudio::DotProduct(const float* A, const float* B, int32 Num)
+{
+#if WHISPER_AUDIO_SSE
+	__m128 Sum0 = _mm_setzero_ps();
+	__m128 Sum1 = _mm_setzero_ps();
+	for (int32 i = 0; i < Num; i += 8)
+	{
+		Sum0 = _mm_add_ps(Sum0, _mm_mul_ps(_mm_loadu_ps(A + i), _mm_loadu_ps(B + i)));
+		Sum1 = _mm_add_ps(Sum1, _mm_mul_ps(_mm_loadu_ps(A + i + 4), _mm_loadu_ps(B + i + 4)));
+	}
+	Sum0 = _mm_add_ps(Sum0, Sum1);
+	Sum0 = _mm_add_ps(Sum0, _mm_movehl_ps(Sum0, Sum0));
+	Sum0 = _mm_add_ss(Sum0, _mm_shuffle_ps(Sum0, Sum0, 1));
+	return _mm_cvtss_f32(Sum0);
+#elif WHISPER_AUDIO_NEON
+	float32x4_t Sum0 = vdupq_n_f32(0.f);
+	float32x4_t Sum1 = vdupq_n_f32(0.f);
+	for (int32 i = 0; i < Num; i += 8)
+	{
+		Sum0 = vmlaq_f32(Sum0, vld1q_f32(A + i), vld1q_f32(B + i));
+		Sum1 = vmlaq_f32(Sum1, vld1q_f32(A + i + 4), vld1q_f32(B + i + 4));
+	}
+	Sum0 = vaddq_f32(Sum0, Sum1);
+	const float32x2_t Sum = vadd_f32(vget_low_f32(Sum0), vget_high_f32(Sum0));
+	return vget_lane_f32(vpadd_f32(Sum, Sum), 0);
+#else
+	float Sum[4] = { 0.f, 0.f, 0.f, 0.f };
+	for (int32 i = 0; i < Num; i += 4)
+	{
+		Sum[0] += A[i] * B[i];
+		Sum[1] += A[i + 1] * B[i + 1];
+		Sum[2] += A[i + 2] * B[i + 2];
+		Sum[3] += A[i + 3] * B[i + 3];
+	}
+	return (Sum[0] + Sum[1]) + (Sum[2] + Sum[3]);
+#endif
+}
+
+double WhisperAudio::BesselI0(double X)
+{
+	// power series, converges quickly for the window's argument range
+	double Sum = 1.0;
+	double Term = 1.0;
+	const double HalfX = X * 0.5;
+	for (int32 k = 1; k < 64; k++)
+	{
+		Term *= (HalfX / k) * (HalfX / k);
+		Sum += Term;
+		if (Term < Sum * 1e-12)
+		{
+			break;
+		}
+	}
+	return Sum;
+}
+
+TSharedPtr<const WhisperAudio::FPolyphaseFilterBank, ESPMode::ThreadSafe> WhisperAudio::CreatePolyphaseFilterBank(int32 InputRate, int32 OutputRate)
+{
+	int32 A = InputRate, B = OutputRate;
+	while (B != 0)
+	{
+		const int32 R = A % B;
+		A = B;
+		B = R;
+	}
+
+	TSharedPtr<FPolyphaseFilterBank, ESPMode::ThreadSafe> Bank = MakeShared<FPolyphaseFilterBank, ESPMode::ThreadSafe>();
+	Bank->InputRate = InputRate;
+	Bank->OutputRate = OutputRate;
+	Bank->Interpolation = OutputRate / A;
+	Bank->Decimation = InputRate / A;
+
+	// filter length in input samples grows with decimation ratio to keep the same transition band at the output rate
+	const double Ratio = FMath::Max(1.0, (double)InputRate / OutputRate);
+	Bank->TapsPerPhase = Align(FMath::CeilToInt(2.0 * ResamplerZeroCrossings * Ratio), 8);
+
+	const int32 L = Bank->Interpolation;
+	const int32 T = Bank->TapsPerPhase;
+	const int32 Length = L * T;
+
+	// prototype filter works at InputRate * L; its center is at L * T / 2, so delay is exactly T / 2 input samples
+	const double Center = Length / 2;
+	const double Cutoff = ResamplerCutoff * 0.5 * FMath::Min(InputRate, OutputRate) / ((double)InputRate * L);
+	const double WindowNorm = 1.0 / BesselI0(ResamplerKaiserBeta);
+
+	Bank->Coefficients.SetNumUninitialized(Length);
+	TArray<double> PhaseTaps;
+	PhaseTaps.SetNumUninitialized(T);
+
+	for (int32 Phase = 0; Phase < L; Phase++)
+	{
+		double PhaseSum = 0.0;
+		for (int32 j = 0; j < T; j++)
+		{
+			const double x = Phase + j * L - Center;
+			const double Arg = 2.0 * Cutoff * x;
+			const double Sinc = FMath::Abs(Arg) < 1e-9 ? 1.0 : FMath::Sin(PI * Arg) / (PI * Arg);
+			const double r = x / Center;
+			const double Window = r * r < 1.0 ? BesselI0(ResamplerKaiserBeta * FMath::Sqrt(1.0 - r * r)) * WindowNorm : 0.0;
+
+			PhaseTaps[j] = Sinc * Window;
+			PhaseSum += PhaseTaps[j];
+		}
+
+		// normalize DC gain of every phase to avoid modulation with the phase pattern
+		float* Taps = Bank->Coefficients.GetData() + Phase * T;
+		for (int32 j = 0; j < T; j++)
+		{
+			Taps[T - 1 - j] = (float)(PhaseTaps[j] / PhaseSum);
+		}
+	}
+
+	return Bank;
+}
+
+TSharedPtr<const WhisperAudio::FPolyphaseFilterBank, ESPMode::ThreadSafe> WhisperAudio::GetPolyphaseFilterBank(int32 InputRate, int32 OutputRate)
+{
+	if (InputRate <= 0 || OutputRate <= 0)
+	{
+		return nullptr;
+	}
+
+	static FCriticalSection CacheSection;
+	static TMap<uint64, TSharedPtr<const FPolyphaseFilterBank, ESPMode::ThreadSafe>> Cache;
+
+	const uint64 Key = ((uint64)InputRate << 32) | (uint32)OutputRate;
+
+	FScopeLock Lock(&CacheSection);
+	if (const auto* Bank = Cache.Find(Key))
+	{
+		return *Bank;
+	}
+	return Cache.Add(Key, CreatePolyphaseFilterBank(InputRate, OutputRate));
+}
+
+bool WhisperAudio::FPolyphaseResampler::Init(int32 InputRate, int32 OutputRate)
+{
+	FilterBank = GetPolyphaseFilterBank(InputRate, OutputRate);
+	Reset();
+	return FilterBank.IsValid();
+}
+
+void WhisperAudio::FPolyphaseResampler::Reset()
+{
+	History.Reset();
+	Position = 0;
+	Phase = 0;
+
+	if (FilterBank.IsValid())
+	{
+		// the first output window is centered at the first input sample
+		History.AddZeroed(FilterBank->TapsPerPhase / 2 - 1);
+	}
+}
+
+void WhisperAudio::FPolyphaseResampler::Process(const float* InData, int32 NumFrames, Audio::FAlignedFloatBuffer& OutData)
+{
+	if (!FilterBank.IsValid() || NumFrames <= 0)
+	{
+		return;
+	}
+
+	History.Append(InData, NumFrames);
+	ProcessBuffered(OutData);
+}
+
+void WhisperAudio::FPolyphaseResampler::Flush(Audio::FAlignedFloatBuffer& OutData)
+{
+	if (!FilterBank.IsValid())
+	{
+		return;
+	}
+
+	History.AddZeroed(FilterBank->TapsPerPhase / 2);
+	ProcessBuffered(OutData);
+	Reset();
+}
+
+void WhisperAudio::FPolyphaseResampler::ProcessBuffered(Audio::FAlignedFloatBuffer& OutData)
+{
+	const FPolyphaseFilterBank& Bank = *FilterBank;
+	const int32 T = Bank.TapsPerPhase;
+	const int32 L = Bank.Interpolation;
+	const int32 M = Bank.Decimation;
+
+	const int32 Available = History.Num() - T + 1 - Position;
+	if (Available > 0)
+	{
+		OutData.Reserve(OutData.Num() + (int32)(((int64)Available * L) / M + 1));
+	}
+
+	const float* Samples = History.GetData();
+	while (Position + T <= History.Num())
+	{
+		OutData.Add(DotProduct(Bank.GetPhase(Phase), Samples + Position, T));
+
+		Phase += M;
+		Position += Phase / L;
+		Phase %= L;
+	}
+
+	// keep only the samples needed for the next window
+	const int32 Consumed = FMath::Min(Position, History.Num());
+	if (Consumed > 0)
+	{
+		History.RemoveAt(0, Consumed, EAllowShrinking::No);
+		Position -= Consumed;
+	}
+}
+
+bool WhisperAudio::Resample(const float* InData, int32 NumFrames, int32 InputRate, int32 OutputRate, Audio::FAlignedFloatBuffer& OutData)
+{
+	const auto FilterBank = GetPolyphaseFilterBank(InputRate, OutputRate);
+	if (!FilterBank.IsValid() || NumFrames < 0)
+	{
+		return false;
+	}
+
+	const FPolyphaseFilterBank& Bank = *FilterBank;
+	const int32 T = Bank.TapsPerPhase;
+	const int32 L = Bank.Interpolation;
+	const int32 M = Bank.Decimation;
+
+	const int32 NumOutput = (int32)(((int64)NumFrames * L + M - 1) / M);
+	OutData.SetNumUninitialized(NumOutput, EAllowShrinking::No);
+
+	// edge windows are assembled with zero padding, the rest read input directly
+	TArray<float, TInlineAllocator<256>> Window;
+	Window.SetNumUninitialized(T);
+
+	int64 Position = -(T / 2 - 1);
+	int32 Phase = 0;
+	for (int32 i = 0; i < NumOutput; i++)
+	{
+		const float* Taps = Bank.GetPhase(Phase);
+		if (Position >= 0 && Position + T <= NumFrames)
+		{
+			OutData[i] = DotProduct(Taps, InData + Position, T);
+		}
+		else
+		{
+			for (int32 j = 0; j < T; j++)
+			{
+				const int64 Index = Position + j;
+				Window[j] = (Index >= 0 && Index < NumFrames) ? InData[Index] : 0.f;
+			}
+			OutData[i] = DotProduct(Taps, Window.GetData(), T);
+		}
+
+		Phase += M;
+		Position += Phase / L;
+		Phase %= L;
+	}
+
+	return true;
+}
@@ -0,0 +1,157 @@
+// (c) Yuri N. K. 2024. All rights reserved.
+// ykasczc@gmail.com
+
+#include "WhisperModelRegistry.h"
+#include "WhisperSubsystem.h"
+#include "Async/Async.h"
+#include "HAL/Event.h"
+#include "HAL/PlatformProcess.h"
+
+THIRD_PARTY_INCLUDES_START
+#include "whisper.h"
+THIRD_PARTY_INCLUDES_END
+
+FWhisperModel::FWhisperModel(const FString& InKey, uint64 InVersion, whisper_context* InContext, TFunction<void()>&& InOnReleased)
+	: Key(InKey)
+	, Version(InVersion)
+	, Context(InContext)
+	, OnReleased(MoveTemp(InOnReleased))
+{
+}
+
+FWhisperModel::~FWhisperModel()
+{
+	UE_LOG(LogWhisper, Log, TEXT("Whisper model released: %s"), *Key);
+
+	whisper_free(Context);
+
+	if (OnReleased)
+	{
+		if (IsInGameThread())
+		{
+			OnReleased();
+		}
+		else
+		{
+			AsyncTask(ENamedThreads::GameThread, MoveTemp(OnReleased));
+		}
+	}
+}
+
+FWhisperModelRegistry::FPendingLoad::FPendingLoad()
+	: Event(FPlatformProcess::GetSynchEventFromPool(true))
+{
+}
+
+FWhisperModelRegistry::FPendingLoad::~FPendingLoad()
+{
+	FPlatformProcess::ReturnSynchEventToPool(Event);
+}
+
+FWhisperModelRegistry& FWhisperModelRegistry::Get()
+{
+	static FWhisperModelRegistry Registry;
+	return Registry;
+}
+
+FWhisperModelPtr FWhisperModelRegistry::Find(const FString& Key)
+{
+	FScopeLock Lock(&Section);
+	if (const auto* Model = Models.Find(Key))
+	{
+		return Model->Pin();
+	}
+	return nullptr;
+}
+
+FWhisperModelPtr FWhisperModelRegistry::FindOrWait(const FString& Key, TFunctionRef<bool()> IsAborted, bool& bOutShouldLoad)
+{
+	bOutShouldLoad = false;
+
+	while (!IsAborted())
+	{
+		TSharedPtr<FPendingLoad, ESPMode::ThreadSafe> PendingLoad;
+		{
+			FScopeLock Lock(&Section);
+			if (const auto* Model = Models.Find(Key))
+			{
+				if (FWhisperModelPtr Existing = Model->Pin())
+				{
+					return Existing;
+				}
+			}
+
+			if (const auto* Pending = PendingLoads.Find(Key))
+			{
+				PendingLoad = *Pending;
+			}
+			else
+			{
+				PendingLoads.Add(Key, MakeShared<FPendingLoad, ESPMode::ThreadSafe>());
+				bOutShouldLoad = true;
+				return nullptr;
+			}
+		}
+
+		// check the result (or abort) when the other load is finished
+		PendingLoad->Event->Wait(50);
+	}
+	return nullptr;
+}
+
+void FWhisperModelRegistry::CancelLoad(const FString& Key)
+{
+	FScopeLock Lock(&Section);
+	FinishLoad(Key);
+}
+
+void FWhisperModelRegistry::FinishLoad(const FString& Key)
+{
+	TSharedPtr<FPendingLoad, ESPMode::ThreadSafe> PendingLoad;
+	if (PendingLoads.RemoveAndCopyValue(Key, PendingLoad))
+	{
+		PendingLoad->Event->Trigger();
+	}
+}
+
+FWhisperModelPtr FWhisperModelRegistry::Register(const FString& Key, uint64 Version, whisper_context* Context, TFunction<void()>&& OnReleased)
+{
+	FWhisperModelPtr NewModel = MakeShared<FWhisperModel, ESPMode::ThreadSafe>(Key, Version, Context, MoveTemp(OnReleased));
+
+	FScopeLock Lock(&Section);
+	FinishLoad(Key);
+
+	// forget released models
+	for (auto It = Models.CreateIterator(); It; ++It)
+	{
+		if (!It->Value.IsValid())
+		{
+			It.RemoveCurrent();
+		}
+	}
+
+	if (const auto* Model = Models.Find(Key))
+	{
+		if (FWhisperModelPtr Existing = Model->Pin())
+		{
+			// NewModel is freed on return
+			UE_LOG(LogWhisper, Log, TEXT("Whisper model is already loaded, sharing it: %s"), *Key);
+			return Existing;
+		}
+	}
+
+	Models.Add(Key, NewModel);
+	return NewModel;
+}
+
+int32 FWhisperModelRegistry::Num()
+{
+	FScopeLock Lock(&Section);
+
+	int32 Result = 0;
+	for (const auto& Model : Models)
+	{
+		Result += Model.Value.IsValid() ? 1 : 0;
+	}
+	return Result;
+}
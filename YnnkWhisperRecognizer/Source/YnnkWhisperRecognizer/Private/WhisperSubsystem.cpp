@@ -5,7 +5,7 @@
 #include "WhisperSubsystem.h"
 #include "Async/Async.h"
 #include "Containers/StringConv.h"
-#include "AudioResampler.h"
+#include "WhisperAudio.h"
 #include "WhisperSubsystem.h"
 #include "YnnkVoiceLipsyncModule.h"
 #include "AsyncRecognizer.h"
@@ -13,6 +13,14 @@
 #include "ZipUFSArchive.h"
 #include "Engine/AssetManager.h"
 #include "Misc/Paths.h"
+#include "UObject/StrongObjectPtr.h"
+#include "HAL/FileManager.h"
+#include "HAL/PlatformProcess.h"
+#include "Hash/CityHash.h"
+#include "Hash/xxhash.h"
+#include "Misc/FileHelper.h"
+#include "Serialization/MemoryReader.h"
+#include "Serialization/MemoryWriter.h"
 
 //#include "GenericPlatform/GenericPlatformFile.h"
 #if PLATFORM_ANDROID
@@ -34,6 +42,289 @@ namespace WhisperCallback
 	bool EncoderBeginCallback(whisper_context* WhisperContext, whisper_state* WhisperState, void* UserData);
 	bool EncoderAbortCallback(void* UserData);
 	void ProgressCallback(whisper_context* WhisperContext, whisper_state* WhisperState, int Progress, void* UserData);
+
+	/** User data of ModelLoadProgressCallback */
+	struct FModelLoadUserData
+	{
+		UWhisperSubsystem* Subsystem;
+		int32 Generation;
+		int32 LastPercent = INDEX_NONE;
+	};
+	bool ModelLoadProgressCallback(size_t BytesLoaded, size_t BytesTotal, int TensorsLoaded, int TensorsTotal, void* UserData);
+	/** Abort callback of warm-up (user data is FModelLoadUserData) */
+	bool WarmUpAbortCallback(void* UserData);
+}
+
+namespace WhisperModelCache
+{
+	/** ggml type to quantize model to on load, GGML_FTYPE_UNKNOWN if quantization is disabled */
+	ggml_ftype GetQuantizationType(const UYnnkWhisperSettings* Settings)
+	{
+		switch (Settings ? Settings->QuantizeOnLoad : EWhisperQuantization::None)
+		{
+			case EWhisperQuantization::Q8_0: return GGML_FTYPE_MOSTLY_Q8_0;
+			case EWhisperQuantization::Q5_1: return GGML_FTYPE_MOSTLY_Q5_1;
+			case EWhisperQuantization::Q4_0: return GGML_FTYPE_MOSTLY_Q4_0;
+			default: break;
+		}
+		return GGML_FTYPE_UNKNOWN;
+	}
+
+	/** Registry key of the model loaded from SourceKey with current quantization settings */
+	FString GetModelKey(const FString& SourceKey, const UYnnkWhisperSettings* Settings)
+	{
+		if (GetQuantizationType(Settings) == GGML_FTYPE_UNKNOWN)
+		{
+			return SourceKey;
+		}
+		return SourceKey + TEXT(":") + StaticEnum<EWhisperQuantization>()->GetNameStringByValue((int64)Settings->QuantizeOnLoad);
+	}
+
+	/** Are quantized models cached on disk? */
+	bool IsEnabled(const UYnnkWhisperSettings* Settings)
+	{
+		return GetQuantizationType(Settings) != GGML_FTYPE_UNKNOWN && Settings->bCacheQuantizedModel;
+	}
+
+	/** Absolute path to the quantized copy of the model, empty if cache is disabled. SourceVersion changes when the source model is modified. */
+	FString GetCachePath(const FString& SourceKey, uint64 SourceVersion, const UYnnkWhisperSettings* Settings)
+	{
+		if (!IsEnabled(Settings))
+		{
+			return FString();
+		}
+
+		const uint64 Hash = CityHash64WithSeed((const char*)*SourceKey, SourceKey.Len() * sizeof(TCHAR), SourceVersion);
+		const FString FileName = FString::Printf(TEXT("%s.%s.%016llx.bin"),
+			*FPaths::GetBaseFilename(SourceKey), *StaticEnum<EWhisperQuantization>()->GetNameStringByValue((int64)Settings->QuantizeOnLoad), Hash);
+
+		return IFileManager::Get().ConvertToAbsolutePathForExternalAppForWrite(*(FPaths::ProjectSavedDir() / TEXT("Whisper") / FileName));
+	}
+
+	/** Save model quantized on load to CachePath */
+	void Save(whisper_context* Context, const FString& CachePath)
+	{
+		if (CachePath.IsEmpty() || !whisper_model_is_quantized_on_load(Context))
+		{
+			// cache is disabled or model wasn't quantized
+			return;
+		}
+
+		IFileManager::Get().MakeDirectory(*FPaths::GetPath(CachePath), true);
+		if (whisper_model_save(Context, TCHAR_TO_ANSI(*CachePath)))
+		{
+			UE_LOG(LogWhisper, Log, TEXT("Quantized whisper model saved to %s"), *CachePath);
+		}
+		else
+		{
+			UE_LOG(LogWhisper, Warning, TEXT("Failed to save quantized whisper model to %s"), *CachePath);
+		}
+	}
+}
+
+namespace WhisperTranscriptionCache
+{
+	/** Changed when format of the cached results or content of the key is changed */
+	constexpr uint32 Version = 2;
+
+	/** Are results cached? Only in editor, where the same audio is often recognized again */
+	bool IsEnabled(const UYnnkWhisperSettings* Settings)
+	{
+		return Settings && Settings->bCacheTranscriptions && GIsEditor;
+	}
+
+	/** Total size of the cached results (bytes), INDEX_NONE until the cache folder is scanned */
+	std::atomic<int64> CacheSize { INDEX_NONE };
+	/** Serializes trimming of the cache */
+	FCriticalSection TrimSection;
+
+	/** Absolute path to the cache folder */
+	FString GetDir()
+	{
+		return IFileManager::Get().ConvertToAbsolutePathForExternalAppForWrite(*(FPaths::ProjectSavedDir() / TEXT("Whisper") / TEXT("Transcriptions")));
+	}
+
+	/** Absolute path to the cached result; files are split to subfolders by the first byte of the key */
+	FString GetPath(const FString& Key)
+	{
+		return GetDir() / Key.Left(2) / Key + TEXT(".bin");
+	}
+
+	/** Delete least recently used results until the cache takes 3/4 of MaxSize, and update CacheSize */
+	void Trim(int64 MaxSize)
+	{
+		FScopeLock Lock(&TrimSection);
+
+		struct FCachedFile
+		{
+			FString Path;
+			int64 Size;
+			FDateTime Time;
+		};
+		TArray<FCachedFile> Files;
+		int64 TotalSize = 0;
+
+		IFileManager::Get().IterateDirectoryStatRecursively(*GetDir(), [&Files, &TotalSize](const TCHAR* Path, const FFileStatData& StatData)
+			{
+				if (!StatData.bIsDirectory && FPaths::GetExtension(Path) == TEXT("bin"))
+				{
+					Files.Add({ Path, StatData.FileSize, StatData.ModificationTime });
+					TotalSize += StatData.FileSize;
+				}
+				return true;
+			}
+		);
+
+		if (TotalSize > MaxSize)
+		{
+			Files.Sort([](const FCachedFile& A, const FCachedFile& B) { return A.Time < B.Time; });
+
+			int32 NumDeleted = 0;
+			for (const auto& File : Files)
+			{
+				if (TotalSize <= MaxSize * 3 / 4)
+				{
+					break;
+				}
+				if (IFileManager::Get().Delete(*File.Path, false, false, true))
+				{
+					TotalSize -= File.Size;
+					NumDeleted++;
+				}
+			}
+			UE_LOG(LogWhisper, Log, TEXT("Transcription cache trimmed: %d results deleted, %.1f MB left"), NumDeleted, TotalSize / (1024.f * 1024.f));
+		}
+
+		CacheSize = TotalSize;
+	}
+
+	void Serialize(FArchive& Ar, FWhisperResult& Result)
+	{
+		uint32 FileVersion = Version;
+		Ar << FileVersion;
+		if (FileVersion != Version)
+		{
+			Ar.SetError();
+			return;
+		}
+
+		Ar << Result.RecognizedString;
+
+		int32 NumWords = Result.RecognizedData.Num();
+		Ar << NumWords;
+		if (Ar.IsLoading())
+		{
+			if (NumWords < 0 || NumWords > Ar.TotalSize())
+			{
+				Ar.SetError();
+				return;
+			}
+			Result.RecognizedData.SetNum(NumWords);
+		}
+		for (auto& Word : Result.RecognizedData)
+		{
+			Ar << Word.Word << Word.TimeStart << Word.TimeEnd;
+		}
+	}
+
+	/** Load cached result of the request with this key */
+	bool Load(const FString& Key, FWhisperResult& OutResult)
+	{
+		TArray<uint8> Data;
+		if (!FFileHelper::LoadFileToArray(Data, *GetPath(Key), FILEREAD_Silent))
+		{
+			return false;
+		}
+
+		FMemoryReader Reader(Data);
+		Serialize(Reader, OutResult);
+		if (Reader.IsError())
+		{
+			UE_LOG(LogWhisper, Warning, TEXT("Invalid cached transcription %s"), *Key);
+			OutResult = FWhisperResult();
+			return false;
+		}
+
+		// used results are kept when the cache is trimmed
+		IFileManager::Get().SetTimeStamp(*GetPath(Key), FDateTime::UtcNow());
+		return true;
+	}
+
+	/** Save result of the request with this key; the file is replaced atomically, so other processes never read a partial result */
+	void Save(const FString& Key, const FWhisperResult& Result)
+	{
+		TArray<uint8> Data;
+		FMemoryWriter Writer(Data);
+		Serialize(Writer, const_cast<FWhisperResult&>(Result));
+
+		const FString Path = GetPath(Key);
+		const FString TempPath = FString::Printf(TEXT("%s.%s.tmp"), *Path, *FGuid::NewGuid().ToString());
+		if (!FFileHelper::SaveArrayToFile(Data, *TempPath) || !IFileManager::Get().Move(*Path, *TempPath, true, true))
+		{
+			UE_LOG(LogWhisper, Warning, TEXT("Failed to save transcription to %s"), *Path);
+			IFileManager::Get().Delete(*TempPath, false, false, true);
+			return;
+		}
+
+		// the folder is scanned once, then only when the size limit is exceeded
+		auto Settings = GetDefault<UYnnkWhisperSettings>();
+		const int64 MaxSize = (int64)FMath::Max(1, Settings ? Settings->TranscriptionCacheSizeMB : 1) * 1024 * 1024;
+		if (CacheSize.load() == INDEX_NONE || (CacheSize += Data.Num()) > MaxSize)
+		{
+			Trim(MaxSize);
+		}
+	}
+}
+
+FWhisperStateSlot::~FWhisperStateSlot()
+{
+	if (State)
+	{
+		whisper_free_state(State);
+	}
+}
+
+void FWhisperRequestQueue::Enqueue(FWhisperRequest&& Request)
+{
+	const int32 Priority = FMath::Clamp((int32)Request.Priority, 0, (int32)EWhisperRequestPriority::Num - 1);
+	Queues[Priority].Push(new FWhisperRequest(MoveTemp(Request)));
+}
+
+bool FWhisperRequestQueue::Dequeue(FWhisperRequest& OutRequest)
+{
+	for (auto& Queue : Queues)
+	{
+		if (FWhisperRequest* Request = Queue.Pop())
+		{
+			OutRequest = MoveTemp(*Request);
+			delete Request;
+			return true;
+		}
+	}
+	return false;
+}
+
+bool FWhisperRequestQueue::IsEmpty() const
+{
+	for (const auto& Queue : Queues)
+	{
+		if (!Queue.IsEmpty())
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+void FWhisperRequestQueue::Empty()
+{
+	for (auto& Queue : Queues)
+	{
+		while (FWhisperRequest* Request = Queue.Pop())
+		{
+			delete Request;
+		}
+	}
 }
 
 void UWhisperSubsystem::NormalizePath(FString& Path)
@@ -130,28 +421,61 @@ void UWhisperSubsystem::Deinitialize()
 {
 	Super::Deinitialize();
 	ReleaseWhisper();
+
+	// released requests and loads are interrupted by abort callbacks, and ingest tasks only prepare audio, so it doesn't take long
+	while (NumRunningTasks.load() > 0 || NumIngestedRequests.load() > 0 || NumLoadingTasks.load() > 0)
+	{
+		FPlatformProcess::Sleep(0.001f);
+	}
 }
 
 void UWhisperSubsystem::ReleaseWhisper()
 {
-	bReady.AtomicSet(false);
+	IngestGeneration++;
 
-	if (WhisperContext)
-	{
-		whisper_free(WhisperContext);
-		WhisperContext = nullptr;
-	}
+	// abort loading
+	LoadGeneration++;
+	bModelLoading = false;
 
-	if (WhisperParameters && WhisperParameters->initial_prompt)
+	// the model itself is freed when its last user releases it
+	FWhisperModelPtr ReleasedModel;
 	{
-		WhisperParameters->initial_prompt = nullptr;
+		// workers read parameters and slots under the lock in RecognizeFromQueue; loaded model is published under it
+		FScopeLock Lock(&DispatchSection);
+		bReady.AtomicSet(false);
+		// busy slots are freed by their tasks
+		for (auto& Slot : StateSlots)
+		{
+			Slot->bBreakWork.AtomicSet(true);
+		}
+		StateSlots.Empty();
+		RequestsQueue.Empty();
+
+		CancelledSerial = 0;
+		CancelledSenders.Empty();
+		CancelledRequests.Empty();
+
+		// the next model can detect languages differently
+		LanguageCache.Empty();
+		ModelIdentity.Empty();
+
+		if (WhisperParameters)
+		{
+			WhisperParameters->initial_prompt = nullptr;
+			delete WhisperParameters;
+			WhisperParameters = nullptr;
+		}
+
+		WhisperContext = nullptr;
+		ReleasedModel = MoveTemp(Model);
 	}
 
-	if (WhisperParameters)
+	// streams with running passes are freed by the passes
+	for (auto& Stream : Streams)
 	{
-		delete WhisperParameters;
-		WhisperParameters = nullptr;
+		Stream.Value->Slot.bBreakWork.AtomicSet(true);
 	}
+	Streams.Empty();
 }
 
 void UWhisperSubsystem::OnModelReady()
@@ -164,6 +488,62 @@ void UWhisperSubsystem::OnModelReady()
 	}
 }
 
+bool UWhisperSubsystem::InitializeStates(const FWhisperModelPtr& InModel, TArray<FWhisperStateSlotPtr>& OutSlots)
+{
+	auto Settings = GetDefault<UYnnkWhisperSettings>();
+	const int32 NumStates = Settings ? FMath::Max(1, Settings->NumRecognitionStates) : 1;
+
+	for (int32 Index = 0; Index < NumStates; Index++)
+	{
+		whisper_state* State = whisper_init_state(InModel->Context);
+		if (!State)
+		{
+			UE_LOG(LogWhisper, Warning, TEXT("Failed to create whisper state %d of %d"), Index + 1, NumStates);
+			break;
+		}
+
+		FWhisperStateSlotPtr Slot = MakeShared<FWhisperStateSlot, ESPMode::ThreadSafe>();
+		Slot->Owner = this;
+		Slot->Index = OutSlots.Num();
+		Slot->Model = InModel;
+		Slot->State = State;
+		OutSlots.Add(MoveTemp(Slot));
+	}
+
+	UE_LOG(LogWhisper, Log, TEXT("Whisper states created: %d"), OutSlots.Num());
+	return OutSlots.Num() > 0;
+}
+
+int32 UWhisperSubsystem::GetAudioContext(whisper_context* Context, int32 NumSamples, int32 DefaultAudioContext) const
+{
+	auto Settings = GetDefault<UYnnkWhisperSettings>();
+	if (!Settings || !Settings->bAdaptiveAudioContext || !Context)
+	{
+		return DefaultAudioContext;
+	}
+
+	const int32 ModelAudioContext = whisper_n_audio_ctx(Context);
+	const int32 MaxAudioContext = DefaultAudioContext > 0 ? FMath::Min(DefaultAudioContext, ModelAudioContext) : ModelAudioContext;
+
+	// encoder frame is 20 ms; round up to 64 frames to use a few graph sizes only
+	const int64 DurationMs = (int64)NumSamples * 1000 / WHISPER_SAMPLE_RATE + FMath::Max(0, Settings->AudioContextMarginMs);
+	const int32 AudioContext = (int32)Align(FMath::DivideAndRoundUp<int64>(DurationMs, 20), 64);
+
+	return FMath::Min(AudioContext, MaxAudioContext);
+}
+
+FWhisperStateSlotPtr UWhisperSubsystem::FindFreeSlot() const
+{
+	for (const auto& Slot : StateSlots)
+	{
+		if (!Slot->bBusy)
+		{
+			return Slot;
+		}
+	}
+	return nullptr;
+}
+
 void UWhisperSubsystem::InitializeParameters()
 {
 	WhisperParameters = new whisper_full_params(whisper_full_default_params(whisper_sampling_strategy::WHISPER_SAMPLING_GREEDY));
@@ -185,35 +565,72 @@ void UWhisperSubsystem::InitializeParameters()
 	WhisperParameters->no_context = false;
 	WhisperParameters->single_segment = false;
 	WhisperParameters->max_tokens = 0;
-	WhisperParameters->audio_ctx = 0;
-	WhisperParameters->temperature_inc = 0.4f;
-	WhisperParameters->entropy_thold = 2.4f;
 	WhisperParameters->token_timestamps = true;
 	WhisperParameters->offset_ms = 0;
 	WhisperParameters->language = "auto";
 
-	WhisperParameters->n_threads = 1;
 	WhisperParameters->suppress_blank = true;
 
 	WhisperParameters->suppress_non_speech_tokens = true;
 	WhisperParameters->suppress_digit_tokens = true;
-	WhisperParameters->beam_search.beam_size = -1.f;
+
+	// threads, sampling strategy, audio_ctx and temperatures
+	ApplySettings();
+
+	// Callbacks user data is set per request to FWhisperStateSlot processing it (see RecognizeFromQueue)
 
 	// Setting up the new segment callback, which is called on every new recognized text segment
 	WhisperParameters->new_segment_callback = WhisperCallback::NewTextSegmentCallback;
-	WhisperParameters->new_segment_callback_user_data = this;
 
 	// Setting up the abort mechanism callback, which is called every time before the encoder starts
 	WhisperParameters->encoder_begin_callback = WhisperCallback::EncoderBeginCallback;
-	WhisperParameters->encoder_begin_callback_user_data = this;
 
 	// Setting up the abort mechanism callback, which is called every time before ggml computation starts
 	WhisperParameters->abort_callback = WhisperCallback::EncoderAbortCallback;
-	WhisperParameters->abort_callback_user_data = this;
 
 	// Setting up the progress callback, which is called every time the progress changes
 	WhisperParameters->progress_callback = WhisperCallback::ProgressCallback;
-	WhisperParameters->progress_callback_user_data = this;
+}
+
+void UWhisperSubsystem::ApplySettings()
+{
+	auto Settings = GetDefault<UYnnkWhisperSettings>();
+	if (!WhisperParameters || !Settings)
+	{
+		return;
+	}
+
+	// parameters are copied by worker threads starting queued requests
+	FScopeLock Lock(&DispatchSection);
+
+	WhisperParameters->strategy = (Settings->SamplingStrategy == EWhisperSamplingStrategy::BeamSearch)
+		? whisper_sampling_strategy::WHISPER_SAMPLING_BEAM_SEARCH
+		: whisper_sampling_strategy::WHISPER_SAMPLING_GREEDY;
+
+	WhisperParameters->n_threads = Settings->GetNumThreads();
+	WhisperParameters->greedy.best_of = FMath::Clamp(Settings->BestOf, 1, WHISPER_MAX_DECODERS);
+	WhisperParameters->beam_search.beam_size = (WhisperParameters->strategy == WHISPER_SAMPLING_BEAM_SEARCH)
+		? FMath::Clamp(Settings->BeamSize, 1, WHISPER_MAX_DECODERS)
+		: -1;
+
+	WhisperParameters->audio_ctx = FMath::Max(0, Settings->AudioContext);
+	if (WhisperContext)
+	{
+		WhisperParameters->audio_ctx = FMath::Min(WhisperParameters->audio_ctx, whisper_n_audio_ctx(WhisperContext));
+		whisper_encoder_cache_set_size(WhisperContext, Settings->GetEncoderCacheSize());
+	}
+
+	WhisperParameters->temperature = Settings->Temperature;
+	WhisperParameters->temperature_inc = Settings->TemperatureIncrement;
+	WhisperParameters->entropy_thold = Settings->EntropyThreshold;
+	WhisperParameters->logprob_thold = Settings->LogProbThreshold;
+
+	UE_LOG(LogWhisper, Log, TEXT("Whisper parameters: threads = %d, strategy = %s, best_of = %d, beam_size = %d, audio_ctx = %d"),
+		WhisperParameters->n_threads,
+		WhisperParameters->strategy == WHISPER_SAMPLING_BEAM_SEARCH ? TEXT("beam search") : TEXT("greedy"),
+		WhisperParameters->greedy.best_of,
+		WhisperParameters->beam_search.beam_size,
+		WhisperParameters->audio_ctx);
 }
 
 bool UWhisperSubsystem::BindWhisper()
@@ -232,6 +649,7 @@ void UWhisperSubsystem::LoadModelFromFile(const FString& FileName, bool bAutoBin
 	if (!bForceReinitialize && IsInitialized())
 	{
 		UE_LOG(LogWhisper, Log, TEXT("Whisper context is already initialized. Skipping reinitialization."));
+		NotifyModelLoaded(INDEX_NONE, true, false);
 		return;
 	}
 
@@ -277,32 +695,77 @@ void UWhisperSubsystem::LoadModelFromFile(const FString& FileName, bool bAutoBin
 	*/
 #endif
 
+	FPaths::NormalizeFilename(FileNameFull);
+
+	// check the same path which is used by whisper to open the file
+	if (!std::filesystem::exists(TCHAR_TO_ANSI(*FileNameFull)))
+	{
+		UE_LOG(LogWhisper, Warning, TEXT("Whisper model file doesn't exist: %s"), *FileNameFull);
+		NotifyModelLoaded(INDEX_NONE, false, false);
+		return;
+	}
+
+	auto Settings = GetDefault<UYnnkWhisperSettings>();
+	whisper_context_params ContextParams = whisper_context_default_params();
+	ContextParams.use_mmap = !Settings || Settings->bMemoryMapModel;
+	ContextParams.quantize_ftype = WhisperModelCache::GetQuantizationType(Settings);
+
+	// keep the model if it's already loaded (i. e. reinitialization with the same file)
+	const FString ModelKey = WhisperModelCache::GetModelKey(FileNameFull, Settings);
+	FWhisperModelPtr LoadedModel = FWhisperModelRegistry::Get().Find(ModelKey);
+
+	// timestamp and size hashed together, so different files can't produce the same version
+	const int64 FileTicks = IFileManager::Get().GetTimeStamp(*FileNameFull).GetTicks();
+	const uint64 FileVersion = CityHash64WithSeed((const char*)&FileTicks, sizeof(FileTicks), (uint64)IFileManager::Get().FileSize(*FileNameFull));
+	const FString CachePath = WhisperModelCache::GetCachePath(FileNameFull, FileVersion, Settings);
+
 	ReleaseWhisper();
 	InitializeParameters();
+	const int32 Generation = BeginModelLoad();
 
-	AsyncTask(ENamedThreads::AnyThread, [this, FileNameFull, bAutoBind]() mutable
+	StartLoadTask([this, Generation, FileNameFull, FileVersion, ModelKey, CachePath, bAutoBind, ContextParams, LoadedModel]() mutable
 		{
-			if (true || FPaths::FileExists(FileNameFull))
+			if (!LoadedModel && !WaitForSharedModel(Generation, ModelKey, LoadedModel))
+			{
+				// aborted
+				return;
+			}
+
+			if (!LoadedModel)
 			{
-				UE_LOG(LogWhisper, Log, TEXT("Whisper initialization from file: %s"), *FileNameFull);
-				WhisperContext = whisper_init_from_file_with_params(TCHAR_TO_ANSI(*FileNameFull), whisper_context_default_params());
-				if (WhisperContext)
+				WhisperCallback::FModelLoadUserData LoadUserData = { this, Generation };
+				ContextParams.load_progress_callback = WhisperCallback::ModelLoadProgressCallback;
+				ContextParams.load_progress_callback_user_data = &LoadUserData;
+
+				whisper_context* Context = nullptr;
+				if (!CachePath.IsEmpty() && FPaths::FileExists(CachePath))
+				{
+					UE_LOG(LogWhisper, Log, TEXT("Whisper initialization from quantized model: %s"), *CachePath);
+					Context = whisper_init_from_file_with_params_no_state(TCHAR_TO_ANSI(*CachePath), ContextParams);
+				}
+				if (!Context && Generation == LoadGeneration)
 				{
-					bReady.AtomicSet(true);
-					if (bAutoBind)
+					UE_LOG(LogWhisper, Log, TEXT("Whisper initialization from file: %s"), *FileNameFull);
+					Context = whisper_init_from_file_with_params_no_state(TCHAR_TO_ANSI(*FileNameFull), ContextParams);
+					if (!Context)
 					{
-						AsyncTask(ENamedThreads::GameThread, [this]()
-							{
-								OnModelReady();
-							}
-						);
+						UE_LOG(LogWhisper, Warning, TEXT("Failed to load whisper model from file: %s"), *FileNameFull);
+						FWhisperModelRegistry::Get().CancelLoad(ModelKey);
+						NotifyModelLoaded(Generation, false, bAutoBind);
+						return;
 					}
+					WhisperModelCache::Save(Context, CachePath);
 				}
+				if (!Context)
+				{
+					// aborted
+					FWhisperModelRegistry::Get().CancelLoad(ModelKey);
+					return;
+				}
+				LoadedModel = FWhisperModelRegistry::Get().Register(ModelKey, FileVersion, Context);
 			}
-			else
-			{
-				UE_LOG(LogWhisper, Warning, TEXT("Whisper model file not found: %s"), *FileNameFull);
-			}
+
+			FinishModelLoad(Generation, MoveTemp(LoadedModel), bAutoBind);
 		}
 	);
 }
@@ -316,250 +779,1299 @@ void UWhisperSubsystem::LoadModelFromAsset(TSoftObjectPtr<UZipUFSArchive> Archiv
 		//UAssetManager::Get().UnloadPrimaryAsset(Archive.Get()->GetPrimaryAssetId());
 		Archive.Reset();
 		UE_LOG(LogWhisper, Log, TEXT("Whisper context is already initialized. Skipping reinitialization."));
+		NotifyModelLoaded(INDEX_NONE, true, false);
 		return;
 	}
 
-	Archive.LoadSynchronous();
+	auto Settings = GetDefault<UYnnkWhisperSettings>();
+	whisper_context_params ContextParams = whisper_context_default_params();
+	ContextParams.use_mmap = !Settings || Settings->bMemoryMapModel;
+	ContextParams.quantize_ftype = WhisperModelCache::GetQuantizationType(Settings);
+
+	const FString ArchivePath = Archive.ToSoftObjectPath().ToString();
+	const FString ModelKey = WhisperModelCache::GetModelKey(ArchivePath, Settings);
+	FWhisperModelPtr LoadedModel = FWhisperModelRegistry::Get().Find(ModelKey);
 
-	if (!IsValid(Archive.Get()) || Archive->Size < 100)
+	UZipUFSArchive* ModelArchive = nullptr;
+	TFunction<void()> ArchiveReference;
+
+	if (!LoadedModel)
 	{
-		UE_LOG(LogWhisper, Warning, TEXT("Whisper model archive is invalid"));
-		return;
+		Archive.LoadSynchronous();
+
+		if (!IsValid(Archive.Get()) || Archive->Size < 100)
+		{
+			UE_LOG(LogWhisper, Warning, TEXT("Whisper model archive is invalid"));
+			NotifyModelLoaded(INDEX_NONE, false, false);
+			return;
+		}
+
+		// model weights are used directly from the bulk data locked by the loading task (locking can read
+		// the payload from disk), so the asset is kept until the model is released; the reference is
+		// released on game thread
+		ModelArchive = Archive.Get();
+		ArchiveReference = [KeptArchive = TStrongObjectPtr<UZipUFSArchive>(ModelArchive)]() {};
 	}
 
 	ReleaseWhisper();
 	InitializeParameters();
+	const int32 Generation = BeginModelLoad();
 
-	AsyncTask(ENamedThreads::AnyThread, [this, Archive, bAutoBind]() mutable
+	StartLoadTask([this, Generation, ArchivePath, ModelKey, ContextParams, ModelArchive, ArchiveReference = MoveTemp(ArchiveReference), LoadedModel, bAutoBind]() mutable
 		{
-			UE_LOG(LogWhisper, Log, TEXT("Whisper initialization from archive: %s"), *Archive->GetName());
-
-			void* DataPtr = nullptr;
-			Archive->Buffer.GetCopy(&DataPtr);
+			const bool bAborted = !LoadedModel && !WaitForSharedModel(Generation, ModelKey, LoadedModel);
+			if ((bAborted || LoadedModel) && ArchiveReference)
+			{
+				// the model was loaded by another user meanwhile (or loading is aborted), so the archive isn't needed
+				AsyncTask(ENamedThreads::GameThread, MoveTemp(ArchiveReference));
+			}
+			if (bAborted)
+			{
+				return;
+			}
 
-			WhisperContext = whisper_init_from_buffer_with_params(DataPtr, Archive->Buffer.GetBulkDataSize(), whisper_context_default_params());
-			if (WhisperContext)
+			if (!LoadedModel)
 			{
-				bReady.AtomicSet(true);
+				const void* ModelData = ModelArchive->Buffer.Lock(LOCK_READ_ONLY);
+				const int64 ModelDataSize = ModelArchive->Buffer.GetBulkDataSize();
+				TFunction<void()> OnModelReleased = [ModelArchive, ArchiveReference = MoveTemp(ArchiveReference)]()
+				{
+					ModelArchive->Buffer.Unlock();
+#if !WITH_EDITOR
+					// the asset can't be resaved in cooked game, so its payload isn't needed anymore
+					ModelArchive->Buffer.RemoveBulkData();
+#endif
+				};
+
+				if (!ModelData)
+				{
+					UE_LOG(LogWhisper, Warning, TEXT("Failed to read whisper model archive: %s"), *ArchivePath);
+					AsyncTask(ENamedThreads::GameThread, MoveTemp(OnModelReleased));
+					FWhisperModelRegistry::Get().CancelLoad(ModelKey);
+					NotifyModelLoaded(Generation, false, bAutoBind);
+					return;
+				}
 
-				// free memory
-				//UAssetManager::Get().UnloadPrimaryAsset(Archive.Get()->GetPrimaryAssetId());
-				Archive.Reset();
+				WhisperCallback::FModelLoadUserData LoadUserData = { this, Generation };
+				ContextParams.load_progress_callback = WhisperCallback::ModelLoadProgressCallback;
+				ContextParams.load_progress_callback_user_data = &LoadUserData;
 
-				AsyncTask(ENamedThreads::GameThread, [this, Archive, bAutoBind]()
+				// the asset can be modified without changing its size, so the model (and its cache) is versioned by hash of the payload;
+				// hashing reads the whole payload, so it's skipped if no cache on disk depends on the version (0 = not versioned)
+				auto Settings = GetDefault<UYnnkWhisperSettings>();
+				const uint64 PayloadHash = WhisperModelCache::IsEnabled(Settings) || WhisperTranscriptionCache::IsEnabled(Settings)
+					? FXxHash64::HashBuffer(ModelData, ModelDataSize).Hash
+					: 0;
+				const FString CachePath = WhisperModelCache::GetCachePath(ArchivePath, PayloadHash, Settings);
+
+				whisper_context* Context = nullptr;
+				if (!CachePath.IsEmpty() && FPaths::FileExists(CachePath))
+				{
+					UE_LOG(LogWhisper, Log, TEXT("Whisper initialization from quantized model: %s"), *CachePath);
+					Context = whisper_init_from_file_with_params_no_state(TCHAR_TO_ANSI(*CachePath), ContextParams);
+					if (Context)
+					{
+						// quantized model doesn't use bulk data
+						AsyncTask(ENamedThreads::GameThread, MoveTemp(OnModelReleased));
+						OnModelReleased = nullptr;
+					}
+					else if (Generation == LoadGeneration)
+					{
+						// not aborted, so the file is broken; it's recreated from the archive below
+						UE_LOG(LogWhisper, Warning, TEXT("Failed to load quantized whisper model: %s"), *CachePath);
+						IFileManager::Get().Delete(*CachePath);
+					}
+				}
+				if (!Context && Generation == LoadGeneration)
 				{
-					// free memory from the asset
-					//UAssetManager::Get().UnloadPrimaryAsset(Archive->GetPrimaryAssetId());
+					UE_LOG(LogWhisper, Log, TEXT("Whisper initialization from archive: %s"), *ArchivePath);
+					Context = whisper_init_from_buffer_in_place_with_params_no_state(ModelData, ModelDataSize, ContextParams);
+					if (!Context)
+					{
+						UE_LOG(LogWhisper, Warning, TEXT("Failed to load whisper model from archive: %s"), *ArchivePath);
+						AsyncTask(ENamedThreads::GameThread, MoveTemp(OnModelReleased));
+						FWhisperModelRegistry::Get().CancelLoad(ModelKey);
+						NotifyModelLoaded(Generation, false, bAutoBind);
+						return;
+					}
 
-					if (bAutoBind)
+					if (whisper_model_is_quantized_on_load(Context))
 					{
-						OnModelReady();
+						// quantized weights are copied, so bulk data can be released right away
+						WhisperModelCache::Save(Context, CachePath);
+						AsyncTask(ENamedThreads::GameThread, MoveTemp(OnModelReleased));
+						OnModelReleased = nullptr;
 					}
 				}
-				);
+				if (!Context)
+				{
+					// aborted
+					AsyncTask(ENamedThreads::GameThread, MoveTemp(OnModelReleased));
+					FWhisperModelRegistry::Get().CancelLoad(ModelKey);
+					return;
+				}
+				LoadedModel = FWhisperModelRegistry::Get().Register(ModelKey, PayloadHash, Context, MoveTemp(OnModelReleased));
 			}
+
+			FinishModelLoad(Generation, MoveTemp(LoadedModel), bAutoBind);
 		}
 	);
 }
 
-void UWhisperSubsystem::RecognizeAudio(const TArray<float>& AudioDataF32)
+bool UWhisperSubsystem::WaitForSharedModel(int32 Generation, const FString& ModelKey, FWhisperModelPtr& OutModel)
 {
-	if (!bReady || !WhisperContext || !WhisperParameters)
-	{
-		UE_LOG(LogWhisper, Log, TEXT("WhisperContext should be initialized first"));
+	bool bShouldLoad = false;
+	OutModel = FWhisperModelRegistry::Get().FindOrWait(ModelKey, [this, Generation]() { return Generation != LoadGeneration; }, bShouldLoad);
+	return OutModel.IsValid() || bShouldLoad;
+}
+
+int32 UWhisperSubsystem::BeginModelLoad()
+{
+	bModelLoading = true;
+	ModelLoadProgress = FWhisperModelLoadProgress();
+	ModelWarmUpTime = 0.f;
+	return ++LoadGeneration;
+}
+
+void UWhisperSubsystem::StartLoadTask(TUniqueFunction<void()>&& Task)
+{
+	// Deinitialize waits for loading tasks; they are aborted by ReleaseWhisper
+	NumLoadingTasks++;
+	AsyncTask(ENamedThreads::AnyThread, [this, Task = MoveTemp(Task)]()
+		{
+			Task();
+			NumLoadingTasks--;
+		}
+	);
+}
+
+bool UWhisperSubsystem::ReportModelLoadProgress(int32 Generation, const FWhisperModelLoadProgress& LoadProgress)
+{
+	if (Generation != LoadGeneration)
+	{
+		return false;
+	}
+
+	AsyncTask(ENamedThreads::GameThread, [WeakThis = TWeakObjectPtr<UWhisperSubsystem>(this), Generation, LoadProgress]()
+		{
+			UWhisperSubsystem* This = WeakThis.Get();
+			if (This && Generation == This->LoadGeneration)
+			{
+				This->ModelLoadProgress = LoadProgress;
+				This->OnModelLoadProgress.Broadcast(This->ModelLoadProgress);
+			}
+		}
+	);
+	return true;
+}
+
+void UWhisperSubsystem::FinishModelLoad(int32 Generation, FWhisperModelPtr&& LoadedModel, bool bAutoBind)
+{
+	if (Generation != LoadGeneration)
+	{
+		UE_LOG(LogWhisper, Log, TEXT("Whisper model loading was aborted"));
+		return;
+	}
+
+	// states are created and warmed up before they are published, so requests and ReleaseWhisper don't see them
+	TArray<FWhisperStateSlotPtr> NewSlots;
+	const bool bSuccess = InitializeStates(LoadedModel, NewSlots);
+	if (bSuccess)
+	{
+		WarmUpStates(Generation, NewSlots);
+
+		if (!UseModel(Generation, MoveTemp(LoadedModel), MoveTemp(NewSlots)))
+		{
+			UE_LOG(LogWhisper, Log, TEXT("Whisper model loading was aborted"));
+			return;
+		}
+		// requests could be queued while the model was loading
+		RecognizeFromQueue();
+	}
+
+	NotifyModelLoaded(Generation, bSuccess, bAutoBind);
+}
+
+void UWhisperSubsystem::WarmUpStates(int32 Generation, const TArray<FWhisperStateSlotPtr>& Slots)
+{
+	auto Settings = GetDefault<UYnnkWhisperSettings>();
+	if (!Settings || !Settings->bWarmUpModel)
+	{
+		return;
+	}
+
+	whisper_full_params Params;
+	{
+		FScopeLock Lock(&DispatchSection);
+		if (!WhisperParameters)
+		{
+			return;
+		}
+		Params = *WhisperParameters;
+	}
+
+	// one encoder pass and a few decoder steps, no results
+	Params.new_segment_callback = nullptr;
+	Params.encoder_begin_callback = nullptr;
+	Params.progress_callback = nullptr;
+	Params.single_segment = true;
+	Params.max_tokens = 4;
+	Params.temperature_inc = 0.f;
+
+	// states aren't published yet, so warm-up is interrupted by ReleaseWhisper through the load generation
+	WhisperCallback::FModelLoadUserData AbortUserData = { this, Generation };
+	Params.abort_callback = WhisperCallback::WarmUpAbortCallback;
+	Params.abort_callback_user_data = &AbortUserData;
+
+	// 2 seconds of silence: whisper_full skips audio shorter than 1 second (100 mel frames), and 1 second
+	// gives 99 frames
+	TArray<float> Silence;
+	Silence.SetNumZeroed(2 * WHISPER_SAMPLE_RATE);
+
+	const double StartTime = FPlatformTime::Seconds();
+	int32 NumStates = 0;
+	for (const auto& Slot : Slots)
+	{
+		if (Generation != LoadGeneration)
+		{
+			// model is released
+			return;
+		}
+
+		// every state has its own compute buffers
+		whisper_full_with_state(Slot->Model->Context, Slot->State, Params, Silence.GetData(), Silence.Num());
+		if (Slot->State->n_encode == 0)
+		{
+			UE_LOG(LogWhisper, Warning, TEXT("Whisper warm-up of state %d didn't run the encoder"), Slot->Index);
+		}
+		NumStates++;
+	}
+
+	ModelWarmUpTime = (float)(FPlatformTime::Seconds() - StartTime);
+	UE_LOG(LogWhisper, Log, TEXT("Whisper warm-up of %d states: %.1f ms"), NumStates, ModelWarmUpTime * 1000.f);
+}
+
+void UWhisperSubsystem::NotifyModelLoaded(int32 Generation, bool bSuccess, bool bAutoBind)
+{
+	AsyncTask(ENamedThreads::GameThread, [WeakThis = TWeakObjectPtr<UWhisperSubsystem>(this), Generation, bSuccess, bAutoBind]()
+		{
+			UWhisperSubsystem* This = WeakThis.Get();
+			if (!This)
+			{
+				// deinitialized meanwhile
+				return;
+			}
+
+			if (Generation != INDEX_NONE)
+			{
+				if (Generation != This->LoadGeneration)
+				{
+					// aborted or replaced by another load
+					return;
+				}
+				This->bModelLoading = false;
+				if (bSuccess)
+				{
+					// shared models are already loaded and don't report progress
+					This->ModelLoadProgress.Progress = 1.f;
+				}
+
+				if (bSuccess && bAutoBind)
+				{
+					This->OnModelReady();
+				}
+			}
+			This->OnModelLoaded.Broadcast(bSuccess);
+		}
+	);
+}
+
+bool UWhisperSubsystem::UseModel(int32 Generation, FWhisperModelPtr&& InModel, TArray<FWhisperStateSlotPtr>&& InSlots)
+{
+	whisper_context* Context = InModel->Context;
+	if (auto Settings = GetDefault<UYnnkWhisperSettings>())
+	{
+		whisper_encoder_cache_set_size(Context, Settings->GetEncoderCacheSize());
+	}
+
+	// ReleaseWhisper changes generation before it takes the lock, so the model is either rejected here or released by it
+	FScopeLock Lock(&DispatchSection);
+	if (Generation != LoadGeneration)
+	{
+		return false;
+	}
+
+	Model = MoveTemp(InModel);
+	WhisperContext = Context;
+	StateSlots = MoveTemp(InSlots);
+	// results of a model without version can't be told from results of its previous version, so they aren't cached
+	ModelIdentity = Model->Version == 0 ? FString() : FString::Printf(TEXT("%s:%016llx:%d:%d:%d:%d:%d:%d"), *Model->Key, Model->Version,
+		whisper_model_type(Context), whisper_model_ftype(Context), whisper_model_n_vocab(Context),
+		whisper_model_n_audio_state(Context), whisper_model_n_text_layer(Context), whisper_model_n_mels(Context));
+
+	bReady.AtomicSet(true);
+	return true;
+}
+
+void UWhisperSubsystem::RecognizeAudio(const TArray<float>& AudioDataF32)
+{
+	if (!IsInitialized())
+	{
+		UE_LOG(LogWhisper, Log, TEXT("WhisperContext should be initialized first"));
+		return;
+	}
+
+	// request without sender: result is only logged
+	FWhisperRequest Request;
+	InitRequest(Request, nullptr, INDEX_NONE, 0);
+	Request.AudioBuffer = AudioDataF32;
+	IngestRequest(MoveTemp(Request), WHISPER_SAMPLE_RATE);
+}
+
+bool UWhisperSubsystem::IsInitialized() const
+{
+	return (bReady && WhisperContext && WhisperParameters && StateSlots.Num() > 0);
+}
+
+FString UWhisperSubsystem::AsTimestamp(int64_t t)
+{
+	int64_t msec = t * 10;
+	int64_t hr = msec / (1000 * 60 * 60);
+	msec = msec - hr * (1000 * 60 * 60);
+	int64_t min = msec / (1000 * 60);
+	msec = msec - min * (1000 * 60);
+	int64_t sec = msec / 1000;
+	msec = msec - sec * 1000;
+
+	FString out;
+	out = out.Printf(TEXT("%02d:%02d:%02d.%03d"), (int)hr, (int)min, (int)sec, (int)msec);
+	return out;
+}
+
+float UWhisperSubsystem::AsSeconds(int64_t t)
+{
+	int64_t msec = t * 10;
+	int64_t hr = msec / (1000 * 60 * 60);
+	msec = msec - hr * (1000 * 60 * 60);
+	int64_t min = msec / (1000 * 60);
+	msec = msec - min * (1000 * 60);
+	int64_t sec = msec / 1000;
+	msec = msec - sec * 1000;
+
+	return (float)sec + (float)(min * 60) + (float)(hr * 60 * 60) + (float)msec * 0.001f;
+}
+
+void UWhisperSubsystem::Recognize_16_Implementation(UAsyncRecognizer* Sender, const TArray<uint8>& PCMData, int32 SampleRate, int32 Id, uint8 Flag)
+{
+	const int32 SamplesNum = PCMData.Num() / 2;
+
+	FWhisperRequest Request;
+	InitRequest(Request, Sender, Id, Flag);
+	Request.AudioBuffer.SetNumUninitialized(SamplesNum);
+
+	// PCMData has to be read before returning anyway, so convert it right here instead of copying it to the task
+	WhisperAudio::ConvertPCM16ToFloat((const int16*)PCMData.GetData(), SamplesNum, Request.AudioBuffer.GetData());
+
+	IngestRequest(MoveTemp(Request), SampleRate);
+}
+
+void UWhisperSubsystem::Recognize_32_Implementation(UAsyncRecognizer* Sender, const TArray<float>& PCMData, int32 SampleRate, int32 Id, uint8 Flag)
+{
+	FWhisperRequest Request;
+	InitRequest(Request, Sender, Id, Flag);
+	Request.AudioBuffer = PCMData;
+
+	IngestRequest(MoveTemp(Request), SampleRate);
+}
+
+void UWhisperSubsystem::InitRequest(FWhisperRequest& Request, UAsyncRecognizer* Sender, int32 Id, uint8 Flag)
+{
+	Request.Sender = Sender;
+	Request.Flag = Flag;
+	Request.Id = Id;
+	Request.Serial = ++LastRequestSerial;
+
+	const EWhisperRequestPriority* Priority = Sender ? SenderPriorities.Find(Sender) : nullptr;
+	Request.Priority = Priority ? *Priority : EWhisperRequestPriority::Normal;
+	Request.Speaker = GetSpeakerKey(Sender);
+}
+
+FString UWhisperSubsystem::GetTranscriptionKey(const FWhisperRequest& Request, int32 SampleRate)
+{
+	auto Settings = GetDefault<UYnnkWhisperSettings>();
+	if (!WhisperTranscriptionCache::IsEnabled(Settings))
+	{
+		return FString();
+	}
+
+	FXxHash128Builder Hash;
+	auto Update = [&Hash](const auto& Value) { Hash.Update(&Value, sizeof(Value)); };
+	auto UpdateString = [&Hash, &Update](const FString& Value)
+	{
+		Update(Value.Len());
+		Hash.Update(*Value, Value.Len() * sizeof(TCHAR));
+	};
+
+	Update(WhisperTranscriptionCache::Version);
+	{
+		FScopeLock Lock(&DispatchSection);
+		if (!WhisperParameters || ModelIdentity.IsEmpty())
+		{
+			return FString();
+		}
+
+		UpdateString(ModelIdentity);
+
+		// language cached for the speaker could replace automatic detection when the request is started, so such results
+		// aren't cached (see RecognizeFromQueue)
+		whisper_full_params Params = *WhisperParameters;
+		if (ApplyCachedLanguage(Request.Speaker, Params))
+		{
+			return FString();
+		}
+
+		// parameters changed by the subsystem and its settings
+		UpdateString(ANSI_TO_TCHAR(Params.language ? Params.language : ""));
+		UpdateString(ANSI_TO_TCHAR(Params.initial_prompt ? Params.initial_prompt : ""));
+		Update(Params.strategy);
+		Update(Params.translate);
+		Update(Params.no_context);
+		Update(Params.single_segment);
+		Update(Params.max_tokens);
+		Update(Params.token_timestamps);
+		Update(Params.offset_ms);
+		Update(Params.audio_ctx);
+		Update(Params.suppress_blank);
+		Update(Params.suppress_non_speech_tokens);
+		Update(Params.suppress_digit_tokens);
+		Update(Params.temperature);
+		Update(Params.temperature_inc);
+		Update(Params.entropy_thold);
+		Update(Params.logprob_thold);
+		Update(Params.greedy.best_of);
+		Update(Params.beam_search.beam_size);
+	}
+
+	// settings applied to the audio before recognition
+	Update(Settings->bVoiceActivityDetection);
+	Update(Settings->VADEnergyThreshold);
+	Update(Settings->VADMinSilenceMs);
+	Update(Settings->VADPaddingMs);
+	Update(Settings->bAdaptiveAudioContext);
+	Update(Settings->AudioContextMarginMs);
+
+	Update(SampleRate);
+	Update(Request.AudioBuffer.Num());
+	Hash.Update(Request.AudioBuffer.GetData(), Request.AudioBuffer.Num() * sizeof(float));
+
+	const FXxHash128 Key = Hash.Finalize();
+	return FString::Printf(TEXT("%016llx%016llx"), Key.HashHigh, Key.HashLow);
+}
+
+void UWhisperSubsystem::IngestRequest(FWhisperRequest&& Request, int32 SampleRate)
+{
+	NumIngestedRequests++;
+	AsyncTask(ENamedThreads::AnyThread, [this, Request = MoveTemp(Request), SampleRate, Generation = IngestGeneration.load()]() mutable
+		{
+			// unchanged audio recognized before with the same model and settings doesn't need any processing
+			Request.TranscriptionKey = GetTranscriptionKey(Request, SampleRate);
+			if (!Request.TranscriptionKey.IsEmpty() && WhisperTranscriptionCache::Load(Request.TranscriptionKey, Request.Result))
+			{
+				Request.AudioBuffer.Empty();
+
+				bool bCancelled = Generation != IngestGeneration.load();
+				if (!bCancelled)
+				{
+					FScopeLock Lock(&DispatchSection);
+					bCancelled = IsRequestCancelled(Request);
+				}
+				if (!bCancelled)
+				{
+					// the subsystem can be deinitialized before the game thread gets the result
+					AsyncTask(ENamedThreads::GameThread, [WeakThis = TWeakObjectPtr<UWhisperSubsystem>(this), Request = MoveTemp(Request)]() mutable
+						{
+							if (UWhisperSubsystem* This = WeakThis.Get())
+							{
+								This->OnRequestComplete(MoveTemp(Request), true);
+							}
+						}
+					);
+				}
+				NumIngestedRequests--;
+				return;
+			}
+
+			if (SampleRate != WHISPER_SAMPLE_RATE)
+			{
+				Audio::FAlignedFloatBuffer ResampledPCMData;
+				if (!WhisperAudio::Resample(Request.AudioBuffer.GetData(), Request.AudioBuffer.Num(), SampleRate, WHISPER_SAMPLE_RATE, ResampledPCMData))
+				{
+					UE_LOG(LogWhisper, Error, TEXT("Failed to resample audio data from %d to %d"), SampleRate, WHISPER_SAMPLE_RATE);
+					NumIngestedRequests--;
+					return;
+				}
+				Request.AudioBuffer = MoveTemp(ResampledPCMData);
+			}
+
+			ApplyVoiceActivityDetection(Request);
+
+			// the model was released while the audio was prepared
+			if (Generation == IngestGeneration.load())
+			{
+				RequestsQueue.Enqueue(MoveTemp(Request));
+			}
+			RecognizeFromQueue();
+
+			// Deinitialize waits for this, so the subsystem isn't touched after it
+			NumIngestedRequests--;
+		}
+	);
+}
+
+void UWhisperSubsystem::ApplyVoiceActivityDetection(FWhisperRequest& Request)
+{
+	Request.TimeMap.Reset();
+
+	auto Settings = GetDefault<UYnnkWhisperSettings>();
+	if (!Settings || !Settings->bVoiceActivityDetection || Request.AudioBuffer.Num() == 0)
+	{
+		return;
+	}
+
+	whisper_vad_params VADParams = whisper_vad_default_params();
+	VADParams.energy_thold = Settings->VADEnergyThreshold;
+	VADParams.min_silence_ms = Settings->VADMinSilenceMs;
+	VADParams.pad_ms = Settings->VADPaddingMs;
+
+	const float* Samples = Request.AudioBuffer.GetData();
+	const int32 NumSamples = Request.AudioBuffer.Num();
+
+	TArray<whisper_vad_region> Regions;
+	Regions.SetNumUninitialized(32);
+	int32 NumRegions = whisper_vad_detect(VADParams, Samples, NumSamples, Regions.GetData(), Regions.Num());
+	if (NumRegions > Regions.Num())
+	{
+		Regions.SetNumUninitialized(NumRegions);
+		NumRegions = whisper_vad_detect(VADParams, Samples, NumSamples, Regions.GetData(), Regions.Num());
+	}
+	Regions.SetNum(NumRegions);
+
+	int64 NumVoiced = 0;
+	for (const auto& Region : Regions)
+	{
+		NumVoiced += Region.end - Region.start;
+	}
+
+	// not worth it
+	if (NumVoiced > NumSamples * 9 / 10)
+	{
+		return;
+	}
+
+	// voiced parts are separated by a short pause, so whisper doesn't merge words across them;
+	// time in the pause is clamped to the end of the previous part by RestoreOriginalTime
+	const int32 NumGapSamples = WHISPER_SAMPLE_RATE / 10;
+
+	Audio::FAlignedFloatBuffer VoicedAudio;
+	VoicedAudio.Reserve(FMath::Max<int64>(NumVoiced + (int64)NumGapSamples * NumRegions, WHISPER_SAMPLE_RATE * 11 / 10));
+
+	for (const auto& Region : Regions)
+	{
+		if (VoicedAudio.Num() > 0)
+		{
+			VoicedAudio.AddZeroed(NumGapSamples);
+		}
+
+		FWhisperTimeSpan& Span = Request.TimeMap.AddDefaulted_GetRef();
+		Span.BufferTime = (float)VoicedAudio.Num() / WHISPER_SAMPLE_RATE;
+		Span.OriginalTime = (float)Region.start / WHISPER_SAMPLE_RATE;
+		Span.Duration = (float)(Region.end - Region.start) / WHISPER_SAMPLE_RATE;
+
+		VoicedAudio.Append(Samples + Region.start, (int32)(Region.end - Region.start));
+	}
+
+	// whisper doesn't recognize audio shorter then 1 second
+	if (VoicedAudio.Num() > 0 && VoicedAudio.Num() < WHISPER_SAMPLE_RATE * 11 / 10)
+	{
+		VoicedAudio.AddZeroed(WHISPER_SAMPLE_RATE * 11 / 10 - VoicedAudio.Num());
+	}
+
+	UE_LOG(LogWhisper, Log, TEXT("Voice activity detection: %d voiced parts, %.2f of %.2f seconds kept"),
+		NumRegions, (float)NumVoiced / WHISPER_SAMPLE_RATE, (float)NumSamples / WHISPER_SAMPLE_RATE);
+
+	Request.AudioBuffer = MoveTemp(VoicedAudio);
+}
+
+void UWhisperSubsystem::RestoreOriginalTime(FWhisperRequest& Request)
+{
+	const auto& TimeMap = Request.TimeMap;
+	if (TimeMap.Num() == 0)
+	{
+		return;
+	}
+
+	auto ToOriginalTime = [&TimeMap](float Time) -> float
+	{
+		const FWhisperTimeSpan* Span = &TimeMap[0];
+		for (const auto& Item : TimeMap)
+		{
+			if (Item.BufferTime > Time)
+			{
+				break;
+			}
+			Span = &Item;
+		}
+		return Span->OriginalTime + FMath::Clamp(Time - Span->BufferTime, 0.f, Span->Duration);
+	};
+
+	for (auto& Word : Request.Result.RecognizedData)
+	{
+		Word.TimeStart = ToOriginalTime(Word.TimeStart);
+		Word.TimeEnd = ToOriginalTime(Word.TimeEnd);
+	}
+}
+
+void UWhisperSubsystem::RecognizeFromQueue()
+{
+	if (!bReady)
+	{
+		return;
+	}
+
+	// called from ingest tasks and workers as well as from the game thread; the queue itself is lock-free,
+	// the lock protects ownership of whisper states and parameters
+	FScopeLock Lock(&DispatchSection);
+
+	// whisper could be released after the check above
+	if (!IsInitialized())
+	{
+		return;
+	}
+
+	// start as many requests as we have free whisper states
+	while (!RequestsQueue.IsEmpty())
+	{
+		FWhisperStateSlotPtr Slot = FindFreeSlot();
+		if (!Slot || !RequestsQueue.Dequeue(Slot->Request))
+		{
+			break;
+		}
+
+		if (IsRequestCancelled(Slot->Request))
+		{
+			Slot->Request = FWhisperRequest();
+			continue;
+		}
+
+		Slot->bBusy = true;
+		Slot->bBreakWork.AtomicSet(false);
+		Slot->RequestSender = Slot->Request.Sender;
+		Slot->RequestId = Slot->Request.Id;
+		Slot->Request.Result = FWhisperResult();
+
+		// callbacks need to know which request they are processing
+		whisper_full_params Params = *WhisperParameters;
+		Params.new_segment_callback_user_data = Slot.Get();
+		Params.encoder_begin_callback_user_data = Slot.Get();
+		Params.abort_callback_user_data = Slot.Get();
+		Params.progress_callback_user_data = Slot.Get();
+		Params.audio_ctx = GetAudioContext(Slot->Model->Context, Slot->Request.AudioBuffer.Num(), Params.audio_ctx);
+		const bool bCachedLanguage = ApplyCachedLanguage(Slot->Request.Speaker, Params);
+
+		// the task owns the slot (and its model) until it's finished, so the slot can be released meanwhile
+		NumRunningTasks++;
+		AsyncTask(ENamedThreads::AnyThread, [this, Slot, Params, bCachedLanguage]() mutable
+			{
+				const auto& AudioBuffer = Slot->Request.AudioBuffer;
+				whisper_context* Context = Slot->Model->Context;
+
+				// empty audio (i. e. no voice found) is recognized as empty string
+				bool bSuccess = AudioBuffer.Num() == 0
+					|| (whisper_full_with_state(Context, Slot->State, Params, AudioBuffer.GetData(), AudioBuffer.Num()) == 0);
+				if (!bSuccess)
+				{
+					UE_LOG(LogWhisper, Log, TEXT("%d: failed to process audio"), AudioBuffer.Num());
+				}
+				else if (AudioBuffer.Num() > 0 && !Slot->bBreakWork)
+				{
+					UpdateLanguageCache(Slot->Request.Speaker, Context, Slot->State, bCachedLanguage);
+				}
+
+				RestoreOriginalTime(Slot->Request);
+
+				// audio isn't needed anymore; only the result goes back to the game thread
+				Slot->Request.AudioBuffer.Empty();
+				bSuccess &= !Slot->bBreakWork;
+
+				// language cached after the key was made isn't a part of the key
+				if (bSuccess && !bCachedLanguage && !Slot->Request.TranscriptionKey.IsEmpty())
+				{
+					WhisperTranscriptionCache::Save(Slot->Request.TranscriptionKey, Slot->Request.Result);
+				}
+				AsyncTask(ENamedThreads::GameThread, [WeakThis = TWeakObjectPtr<UWhisperSubsystem>(this), bSuccess, Request = MoveTemp(Slot->Request)]() mutable
+					{
+						if (UWhisperSubsystem* This = WeakThis.Get())
+						{
+							This->OnRequestComplete(MoveTemp(Request), bSuccess);
+						}
+					}
+				);
+
+				// release the state and pick the next request on this thread; if the slot was released
+				// while the request was processed, it's freed with the last reference
+				{
+					FScopeLock Lock(&DispatchSection);
+					Slot->bBusy = false;
+					Slot->RequestSender.Reset();
+				}
+				Slot.Reset();
+
+				RecognizeFromQueue();
+				NumRunningTasks--;
+			}
+		);
+	}
+
+	// nothing left to cancel: forget cancelled senders and requests (ingest tasks enqueue before they are uncounted)
+	if (NumIngestedRequests.load() == 0 && RequestsQueue.IsEmpty())
+	{
+		CancelledSenders.Reset();
+		CancelledRequests.Reset();
+	}
+}
+
+void UWhisperSubsystem::OnRequestComplete(FWhisperRequest&& Request, bool bSuccess)
+{
+	FWhisperResult& Result = Request.Result;
+	Result.RecognizedString.ReplaceInline(TEXT("  "), TEXT(" "));
+	Result.RecognizedString.TrimStartAndEndInline();
+
+	if (bSuccess)
+	{
+		if (UAsyncRecognizer* Sender = Request.Sender.Get())
+		{
+			Sender->OnExternalRecognizeResult(Request.Id, Request.Flag, Result.RecognizedString, Result.RecognizedData);
+		}
+		else
+		{
+			UE_LOG(LogWhisper, Log, TEXT("Recognized text: \"%s\""), *Result.RecognizedString);
+		}
+	}
+}
+
+void UWhisperSubsystem::SetLanguage_Implementation(const FString& InLanguage)
+{
+	Language = InLanguage;
+	if (WhisperParameters)
+	{
+		FString Code = Language.TrimStartAndEnd().ToLower();
+		// language names used by YnnkVoiceLipsync which aren't whisper codes
+		if (Code == TEXT("cn"))
+		{
+			Code = TEXT("zh");
+		}
+		else if (Code == TEXT("br - pt"))
+		{
+			Code = TEXT("pt");
+		}
+
+		// any whisper language code ("en", "uk", "ja"...) or full name ("english") is accepted
+		const bool bAutoLanguage = Code.IsEmpty() || Code == TEXT("auto");
+		const int32 LangId = bAutoLanguage ? INDEX_NONE : whisper_lang_id(TCHAR_TO_ANSI(*Code));
+		if (!bAutoLanguage && LangId == INDEX_NONE)
+		{
+			UE_LOG(LogWhisper, Warning, TEXT("Unknown language: %s. Language will be detected automatically."), *InLanguage);
+		}
+
+		FScopeLock Lock(&DispatchSection);
+		UE_LOG(LogWhisper, Log, TEXT("Whisper set new language: %s"), *InLanguage);
+
+		// whisper_lang_str returns static string, so it can be kept in parameters
+		WhisperParameters->language = LangId == INDEX_NONE ? "auto" : whisper_lang_str(LangId);
+	}
+}
+
+void UWhisperSubsystem::StopRecognition_Implementation(UAsyncRecognizer* Sender)
+{
+	CancelRequests(Sender, INDEX_NONE);
+}
+
+void UWhisperSubsystem::SetSenderPriority(UAsyncRecognizer* Sender, EWhisperRequestPriority Priority)
+{
+	if (Sender)
+	{
+		SenderPriorities.Add(Sender, Priority);
+	}
+}
+
+void UWhisperSubsystem::SetSenderSpeaker(UAsyncRecognizer* Sender, FName Speaker)
+{
+	if (!Sender)
+	{
+		return;
+	}
+
+	if (Speaker.IsNone())
+	{
+		SenderSpeakers.Remove(Sender);
+	}
+	else
+	{
+		SenderSpeakers.Add(Sender, Speaker);
 	}
+}
 
-	TempRequest.AudioBuffer = AudioDataF32;
-	RecognizedString = "";
+bool UWhisperSubsystem::GetSenderLanguage(UAsyncRecognizer* Sender, FString& OutLanguage, float& OutConfidence)
+{
+	const FName Speaker = GetSpeakerKey(Sender);
 
-	AsyncTask(ENamedThreads::AnyThread, [this]() mutable
-		{
-			if (whisper_full_parallel(WhisperContext, *WhisperParameters, TempRequest.AudioBuffer.GetData(), TempRequest.AudioBuffer.Num(), 1) != 0)
-			{
-				UE_LOG(LogWhisper, Log, TEXT("%d: failed to process audio"), TempRequest.AudioBuffer.Num());
-			}
-		}
-	);
+	FScopeLock Lock(&DispatchSection);
+	if (const FWhisperLanguageInfo* Info = Speaker.IsNone() ? nullptr : LanguageCache.Find(Speaker))
+	{
+		OutLanguage = ANSI_TO_TCHAR(whisper_lang_str(Info->LangId));
+		OutConfidence = Info->Confidence;
+		return true;
+	}
+
+	OutLanguage.Empty();
+	OutConfidence = 0.f;
+	return false;
 }
 
-bool UWhisperSubsystem::IsInitialized() const
+void UWhisperSubsystem::ClearLanguageCache()
 {
-	return (bReady && WhisperContext && WhisperParameters);
+	FScopeLock Lock(&DispatchSection);
+	LanguageCache.Empty();
 }
 
-FString UWhisperSubsystem::AsTimestamp(int64_t t)
+FName UWhisperSubsystem::GetSpeakerKey(UAsyncRecognizer* Sender) const
 {
-	int64_t msec = t * 10;
-	int64_t hr = msec / (1000 * 60 * 60);
-	msec = msec - hr * (1000 * 60 * 60);
-	int64_t min = msec / (1000 * 60);
-	msec = msec - min * (1000 * 60);
-	int64_t sec = msec / 1000;
-	msec = msec - sec * 1000;
-
-	FString out;
-	out = out.Printf(TEXT("%02d:%02d:%02d.%03d"), (int)hr, (int)min, (int)sec, (int)msec);
-	return out;
+	if (!Sender)
+	{
+		return NAME_None;
+	}
+	const FName* Speaker = SenderSpeakers.Find(Sender);
+	return Speaker ? *Speaker : FName(*Sender->GetPathName());
 }
 
-float UWhisperSubsystem::AsSeconds(int64_t t)
+bool UWhisperSubsystem::ApplyCachedLanguage(FName Speaker, whisper_full_params& Params) const
 {
-	int64_t msec = t * 10;
-	int64_t hr = msec / (1000 * 60 * 60);
-	msec = msec - hr * (1000 * 60 * 60);
-	int64_t min = msec / (1000 * 60);
-	msec = msec - min * (1000 * 60);
-	int64_t sec = msec / 1000;
-	msec = msec - sec * 1000;
+	auto Settings = GetDefault<UYnnkWhisperSettings>();
+	if (Speaker.IsNone() || !Settings || !Settings->bCacheDetectedLanguage)
+	{
+		return false;
+	}
 
-	return (float)sec + (float)(min * 60) + (float)(hr * 60 * 60) + (float)msec * 0.001f;
+	// language set with SetLanguage is always used
+	if (Params.language && *Params.language && FCStringAnsi::Strcmp(Params.language, "auto") != 0)
+	{
+		return false;
+	}
+
+	const FWhisperLanguageInfo* Info = LanguageCache.Find(Speaker);
+	if (!Info || Info->Confidence < Settings->LanguageConfidenceThreshold)
+	{
+		return false;
+	}
+
+	Params.language = whisper_lang_str(Info->LangId);
+	return true;
 }
 
-void UWhisperSubsystem::Recognize_16_Implementation(UAsyncRecognizer* Sender, const TArray<uint8>& PCMData, int32 SampleRate, int32 Id, uint8 Flag)
+void UWhisperSubsystem::UpdateLanguageCache(FName Speaker, whisper_context* Context, whisper_state* State, bool bCachedLanguage)
 {
-	int32 SamplesNum = PCMData.Num() / 2;
+	auto Settings = GetDefault<UYnnkWhisperSettings>();
+	if (Speaker.IsNone() || !Settings || !Settings->bCacheDetectedLanguage)
+	{
+		return;
+	}
 
-	TempRequest.Sender = Sender;
-	TempRequest.Flag = Flag;
-	TempRequest.Id = Id;
-	TempRequest.AudioBuffer.SetNumUninitialized(SamplesNum);
-	
-	AsyncTask(ENamedThreads::AnyThread, [this, PCMData, SamplesNum, SampleRate]() mutable
+	// 0 if language wasn't detected by this request
+	const float LangProb = whisper_full_lang_prob_from_state(State);
+
+	if (LangProb > 0.f)
+	{
+		FScopeLock Lock(&DispatchSection);
+		FWhisperLanguageInfo& Info = LanguageCache.FindOrAdd(Speaker);
+		Info.LangId = whisper_full_lang_id_from_state(State);
+		Info.Confidence = LangProb;
+	}
+	else if (bCachedLanguage)
+	{
+		// text tokens only: special and timestamp tokens follow EOT
+		const whisper_token TokenEot = whisper_token_eot(Context);
+		double TokensProb = 0.0;
+		int32 NumTokens = 0;
+
+		const int32 NumSegments = whisper_full_n_segments_from_state(State);
+		for (int32 i = 0; i < NumSegments; i++)
 		{
-			int16* pcm16 = (int16*)&PCMData[0];
-			for (int32 i = 0; i < SamplesNum; i++)
+			const int32 SegmentTokens = whisper_full_n_tokens_from_state(State, i);
+			for (int32 j = 0; j < SegmentTokens; j++)
 			{
-				TempRequest.AudioBuffer[i] = float(pcm16[i]) / 32768.0f;
-			}
-
-			AsyncTask(ENamedThreads::GameThread, [this, SampleRate]()
+				if (whisper_full_get_token_id_from_state(State, i, j) < TokenEot)
 				{
-					ResampleTempBuffer(SampleRate);
+					TokensProb += whisper_full_get_token_p_from_state(State, i, j);
+					NumTokens++;
 				}
-			);
+			}
 		}
-	);
+
+		if (NumTokens > 0)
+		{
+			// speech in a different language is recognized with low probabilities, so it lowers confidence until the language is detected again
+			FScopeLock Lock(&DispatchSection);
+			if (FWhisperLanguageInfo* Info = LanguageCache.Find(Speaker))
+			{
+				Info->Confidence = 0.5f * (Info->Confidence + (float)(TokensProb / NumTokens));
+			}
+		}
+	}
 }
 
-void UWhisperSubsystem::Recognize_32_Implementation(UAsyncRecognizer* Sender, const TArray<float>& PCMData, int32 SampleRate, int32 Id, uint8 Flag)
+void UWhisperSubsystem::CancelRequests(UAsyncRecognizer* Sender, int32 Id)
 {
-	TempRequest.Sender = Sender;
-	TempRequest.Flag = Flag;
-	TempRequest.Id = Id;
-	TempRequest.AudioBuffer = PCMData;
+	// queued requests are dropped when they are dequeued; all requests created so far are affected
+	const uint32 Serial = LastRequestSerial.load();
+	const TWeakObjectPtr<UAsyncRecognizer> WeakSender(Sender);
+
+	FScopeLock Lock(&DispatchSection);
+
+	if (!Sender)
+	{
+		CancelledSerial = Serial;
+	}
+	else if (Id == INDEX_NONE)
+	{
+		CancelledSenders.Add(WeakSender, Serial);
+	}
+	else
+	{
+		CancelledRequests.Add(MakeTuple(WeakSender, Id), Serial);
+	}
 
-	ResampleTempBuffer(SampleRate);
+	for (auto& Slot : StateSlots)
+	{
+		if (Slot->bBusy && (!Sender || (Slot->RequestSender == WeakSender && (Id == INDEX_NONE || Slot->RequestId == Id))))
+		{
+			Slot->bBreakWork.AtomicSet(true);
+		}
+	}
 }
 
-void UWhisperSubsystem::ResampleTempBuffer(int32 DataSampleRate)
+bool UWhisperSubsystem::IsRequestCancelled(const FWhisperRequest& Request) const
 {
-	if (DataSampleRate != WHISPER_SAMPLE_RATE)
+	if (Request.Serial <= CancelledSerial)
 	{
-		AsyncTask(ENamedThreads::AnyThread, [this, OriginalSampleRate = DataSampleRate]() mutable
-			{
-				Audio::FAlignedFloatBuffer& PCMData = TempRequest.AudioBuffer;
-				Audio::FAlignedFloatBuffer ResampledPCMData;
+		return true;
+	}
 
-				const Audio::FResamplingParameters ResampleParameters =
-				{
-					Audio::EResamplingMethod::Linear,
-					1,
-					static_cast<float>(OriginalSampleRate),
-					static_cast<float>(WHISPER_SAMPLE_RATE),
-					PCMData
-				};
+	// weak pointers are matched by object index and serial number, so requests of a destroyed sender are still found
+	if (const uint32* Serial = CancelledSenders.Find(Request.Sender))
+	{
+		if (Request.Serial <= *Serial)
+		{
+			return true;
+		}
+	}
+	if (const uint32* Serial = CancelledRequests.Find(MakeTuple(Request.Sender, Request.Id)))
+	{
+		if (Request.Serial <= *Serial)
+		{
+			return true;
+		}
+	}
+	return false;
+}
 
-				ResampledPCMData.AddUninitialized(Audio::GetOutputBufferSize(ResampleParameters));
-				Audio::FResamplerResults ResampleResults;
-				ResampleResults.OutBuffer = &ResampledPCMData;
+int32 UWhisperSubsystem::BeginStream(int32 SampleRate)
+{
+	if (!IsInitialized())
+	{
+		UE_LOG(LogWhisper, Log, TEXT("WhisperContext should be initialized first"));
+		return INDEX_NONE;
+	}
+	if (SampleRate <= 0)
+	{
+		UE_LOG(LogWhisper, Warning, TEXT("Invalid sample rate of audio stream: %d"), SampleRate);
+		return INDEX_NONE;
+	}
 
-				if (Audio::Resample(ResampleParameters, ResampleResults))
-				{
-					PCMData = MoveTemp(ResampledPCMData);
-					AsyncTask(ENamedThreads::GameThread, [this]()
-						{
-							ResampleTempBuffer(WHISPER_SAMPLE_RATE);
-						}
-					);
-				}
-				else
+	// the model can be published by the loading thread
+	FWhisperModelPtr StreamModel;
+	{
+		FScopeLock Lock(&DispatchSection);
+		StreamModel = Model;
+	}
+
+	// stream has its own state to keep mel spectrogram of the last 30 seconds
+	whisper_state* State = StreamModel ? whisper_init_state(StreamModel->Context) : nullptr;
+	if (!State)
+	{
+		UE_LOG(LogWhisper, Warning, TEXT("Failed to create whisper state for audio stream"));
+		return INDEX_NONE;
+	}
+
+	FWhisperStreamPtr Stream = MakeShared<FWhisperStream, ESPMode::ThreadSafe>();
+	Stream->StreamId = ++LastStreamId;
+	Stream->SampleRate = SampleRate;
+	if (SampleRate != WHISPER_SAMPLE_RATE)
+	{
+		Stream->Resampler.Init(SampleRate, WHISPER_SAMPLE_RATE);
+	}
+	Stream->Slot.Owner = this;
+	Stream->Slot.Model = StreamModel;
+	Stream->Slot.State = State;
+	// language detected in the stream is cached for its next passes
+	Stream->Slot.Request.Speaker = FName(TEXT("WhisperStream"), Stream->StreamId);
+
+	const int32 StreamId = Stream->StreamId;
+	Streams.Add(StreamId, MoveTemp(Stream));
+
+	UE_LOG(LogWhisper, Log, TEXT("Audio stream %d started (%d Hz)"), StreamId, SampleRate);
+	return StreamId;
+}
+
+void UWhisperSubsystem::PushStreamAudio(int32 StreamId, const TArray<float>& PCMData)
+{
+	// audio capture callbacks aren't called on game thread
+	if (!IsInGameThread())
+	{
+		AsyncTask(ENamedThreads::GameThread, [WeakThis = TWeakObjectPtr<UWhisperSubsystem>(this), StreamId, PCMData]()
+			{
+				if (UWhisperSubsystem* This = WeakThis.Get())
 				{
-					UE_LOG(LogWhisper, Error, TEXT("Failed to resample audio data from %d to %d"), OriginalSampleRate, WHISPER_SAMPLE_RATE);
+					This->PushStreamAudio(StreamId, PCMData);
 				}
 			}
 		);
+		return;
+	}
+
+	auto StreamPtr = Streams.Find(StreamId);
+	if (!StreamPtr || (*StreamPtr)->bEnding || PCMData.Num() == 0)
+	{
+		return;
+	}
+	const FWhisperStreamPtr Stream = *StreamPtr;
+
+	if (Stream->Resampler.IsInitialized())
+	{
+		// resampler keeps the filter history, so chunks join without discontinuities
+		Stream->Resampler.Process(PCMData.GetData(), PCMData.Num(), Stream->PendingAudio);
 	}
 	else
 	{
-		bool bStartRecognition = RequestsQueue.IsEmpty();
-		RequestsQueue.Enqueue(TempRequest);
+		Stream->PendingAudio.Append(PCMData);
+	}
 
-		if (bStartRecognition)
-		{
-			RecognizeFromQueue();
-		}
+	TryStartStreamPass(Stream);
+}
+
+void UWhisperSubsystem::EndStream(int32 StreamId)
+{
+	auto StreamPtr = Streams.Find(StreamId);
+	if (!StreamPtr || (*StreamPtr)->bEnding)
+	{
+		return;
+	}
+
+	// if the stream is busy, final pass is started by OnStreamPassComplete
+	const FWhisperStreamPtr Stream = *StreamPtr;
+	Stream->bEnding = true;
+	if (Stream->Resampler.IsInitialized())
+	{
+		Stream->Resampler.Flush(Stream->PendingAudio);
 	}
+	TryStartStreamPass(Stream, true);
 }
 
-void UWhisperSubsystem::RecognizeFromQueue()
+bool UWhisperSubsystem::IsStreamActive(int32 StreamId) const
+{
+	auto StreamPtr = Streams.Find(StreamId);
+	return StreamPtr && !(*StreamPtr)->bEnding;
+}
+
+void UWhisperSubsystem::TryStartStreamPass(const FWhisperStreamPtr& Stream, bool bFinal)
 {
-	if (!RequestsQueue.IsEmpty())
+	auto Settings = GetDefault<UYnnkWhisperSettings>();
+	if (!Settings || !WhisperParameters || Stream->Slot.bBusy)
+	{
+		return;
+	}
+
+	const int32 StepSamples = Settings->StreamStepMs * WHISPER_SAMPLE_RATE / 1000;
+	if (!bFinal && Stream->PendingAudio.Num() < StepSamples)
+	{
+		return;
+	}
+
+	Stream->Slot.bBusy = true;
+	Stream->Slot.bBreakWork.AtomicSet(false);
+	Stream->Slot.Request.Result = FWhisperResult();
+
+	whisper_full_params Params = *WhisperParameters;
+	Params.new_segment_callback_user_data = &Stream->Slot;
+	Params.encoder_begin_callback_user_data = &Stream->Slot;
+	Params.abort_callback_user_data = &Stream->Slot;
+	// no need to log progress of every pass
+	Params.progress_callback = nullptr;
+	// every pass recognizes the window from scratch
+	Params.no_context = true;
+
+	bool bCachedLanguage = false;
 	{
-		RecognizedString = TEXT("");
-		RecognizedData.Empty();
-		bBreakWork.AtomicSet(false);
+		FScopeLock Lock(&DispatchSection);
+		bCachedLanguage = ApplyCachedLanguage(Stream->Slot.Request.Speaker, Params);
+	}
 
-		AsyncTask(ENamedThreads::AnyThread, [this]() mutable
+	const int64 MaxWindowFrames = FMath::Clamp(Settings->StreamWindowMs / 10, 100, WHISPER_CHUNK_SIZE * 100);
+	const float Overlap = Settings->StreamOverlapMs * 0.001f;
+
+	// the pass owns the stream (and its model) until it's finished, so the stream can be released meanwhile
+	NumRunningTasks++;
+	AsyncTask(ENamedThreads::AnyThread, [this, StreamId = Stream->StreamId, Stream, Params, Audio = MoveTemp(Stream->PendingAudio), MaxWindowFrames, Overlap, bFinal, bCachedLanguage]() mutable
+		{
+			whisper_context* Context = Stream->Slot.Model->Context;
+			whisper_state* State = Stream->Slot.State;
+
+			// compute mel spectrogram only for the new audio
+			whisper_stream_push_pcm(Context, State, Audio.GetData(), Audio.Num());
+			const int64 NumFrames = whisper_stream_n_frames(State);
+
+			// window starts a bit before the last committed word (100 frames per second)
+			int64 WindowStart = FMath::Max<int64>(0, FMath::FloorToInt64((Stream->CommittedTime - Overlap) * 100.f));
+			WindowStart = FMath::Max(WindowStart, NumFrames - MaxWindowFrames);
+			const int32 WindowFrames = (int32)(NumFrames - WindowStart);
+
+			bool bSuccess = true;
+			TArray<FSingeWordData> CommittedWords, PartialWords;
+
+			// whisper doesn't process audio shorter then 1 second
+			if (WindowFrames >= 100)
 			{
-				RequestsQueue.Dequeue(ActiveRequest);
-				if (whisper_full_parallel(WhisperContext, *WhisperParameters, ActiveRequest.AudioBuffer.GetData(), ActiveRequest.AudioBuffer.Num(), 1) != 0)
+				Params.audio_ctx = GetAudioContext(Context, WindowFrames * WHISPER_HOP_LENGTH, Params.audio_ctx);
+
+				bSuccess = (whisper_stream_set_mel(Context, State, WindowFrames) > 0)
+					&& (whisper_full_with_state(Context, State, Params, nullptr, 0) == 0);
+
+				if (bSuccess)
 				{
-					UE_LOG(LogWhisper, Log, TEXT("%d: failed to process audio"), ActiveRequest.AudioBuffer.Num());
+					if (!Stream->Slot.bBreakWork)
+					{
+						UpdateLanguageCache(Stream->Slot.Request.Speaker, Context, State, bCachedLanguage);
+					}
+					UWhisperSubsystem::UpdateStreamHypothesis(*Stream, WindowStart * 0.01f, WindowFrames * 0.01f, WindowFrames >= MaxWindowFrames, bFinal, CommittedWords, PartialWords);
+				}
+				else
+				{
+					UE_LOG(LogWhisper, Log, TEXT("Failed to process audio stream %d"), StreamId);
 				}
 			}
-		);
-	}
+			else if (bFinal)
+			{
+				// nothing new to recognize
+				CommittedWords = MoveTemp(Stream->Hypothesis);
+			}
+
+			AsyncTask(ENamedThreads::GameThread, [WeakThis = TWeakObjectPtr<UWhisperSubsystem>(this), StreamId, Stream, CommittedWords = MoveTemp(CommittedWords), PartialWords = MoveTemp(PartialWords), bSuccess, bFinal]() mutable
+				{
+					if (UWhisperSubsystem* This = WeakThis.Get())
+					{
+						This->OnStreamPassComplete(StreamId, Stream, MoveTemp(CommittedWords), MoveTemp(PartialWords), bSuccess, bFinal);
+					}
+				}
+			);
+			NumRunningTasks--;
+		}
+	);
 }
 
-void UWhisperSubsystem::SetLanguage_Implementation(const FString& InLanguage)
+void UWhisperSubsystem::UpdateStreamHypothesis(FWhisperStream& Stream, float WindowStart, float WindowLength, bool bWindowFull, bool bFinal, TArray<FSingeWordData>& OutCommitted, TArray<FSingeWordData>& OutPartial)
 {
-	Language = InLanguage;
-	if (WhisperParameters)
+	// words of this pass in stream time
+	TArray<FSingeWordData> Words = MoveTemp(Stream.Slot.Request.Result.RecognizedData);
+	for (auto& Word : Words)
 	{
-		UE_LOG(LogWhisper, Log, TEXT("Whisper set new language: %s"), *InLanguage);
+		Word.TimeStart += WindowStart;
+		Word.TimeEnd += WindowStart;
+	}
+
+	// the window overlaps committed words
+	Words.RemoveAll([CommittedTime = Stream.CommittedTime](const FSingeWordData& Word) { return Word.TimeEnd <= CommittedTime + 0.05f; });
+
+	int32 NumStable = 0;
+	if (bFinal)
+	{
+		NumStable = Words.Num();
+	}
+	else
+	{
+		// local agreement: commit words confirmed by two passes in a row
+		while (NumStable < Words.Num() && NumStable < Stream.Hypothesis.Num() && Words[NumStable].Word == Stream.Hypothesis[NumStable].Word)
+		{
+			NumStable++;
+		}
+
+		// the window can't grow anymore, so commit older half of it before it's cut off
+		if (bWindowFull)
+		{
+			const float CommitBefore = WindowStart + WindowLength * 0.5f;
+			while (NumStable < Words.Num() && Words[NumStable].TimeEnd < CommitBefore)
+			{
+				NumStable++;
+			}
+		}
+	}
 
-		//const char* lang = StringCast<ANSICHAR>(*Language.ToLower()).Get();
-
-		/**/ if (Language == TEXT("EN"))
-			WhisperParameters->language = "en";
-		else if (Language == TEXT("RU"))
-			WhisperParameters->language = "ru";
-		else if (Language == TEXT("CN"))
-			WhisperParameters->language = "zh";
-		else if (Language == TEXT("IT"))
-			WhisperParameters->language = "it";
-		else if (Language == TEXT("DE"))
-			WhisperParameters->language = "de";
-		else if (Language == TEXT("FR"))
-			WhisperParameters->language = "fr";
-		else if (Language == TEXT("ES"))
-			WhisperParameters->language = "es";
-		else if (Language == TEXT("BR - PT") || Language == TEXT("PT"))
-			WhisperParameters->language = "pt";
-		else if (Language == TEXT("PL"))
-			WhisperParameters->language = "pl";
-		else if (Language == TEXT("TR"))
-			WhisperParameters->language = "tr";
+	OutCommitted.Append(Words.GetData(), NumStable);
+	OutPartial.Append(Words.GetData() + NumStable, Words.Num() - NumStable);
+
+	if (OutCommitted.Num() > 0)
+	{
+		Stream.CommittedTime = OutCommitted.Last().TimeEnd;
 	}
+	Stream.Hypothesis = OutPartial;
 }
 
-void UWhisperSubsystem::StopRecognition_Implementation(UAsyncRecognizer* Sender)
+void UWhisperSubsystem::OnStreamPassComplete(int32 StreamId, const FWhisperStreamPtr& Stream, TArray<FSingeWordData>&& CommittedWords, TArray<FSingeWordData>&& PartialWords, bool bSuccess, bool bFinal)
 {
-	RequestsQueue.Empty();
-	bBreakWork.AtomicSet(true);
+	// stream could be released while the pass was processed
+	auto StreamPtr = Streams.Find(StreamId);
+	if (!StreamPtr || *StreamPtr != Stream)
+	{
+		return;
+	}
+
+	Stream->Slot.bBusy = false;
+
+	if (bSuccess && !Stream->Slot.bBreakWork && (bFinal || CommittedWords.Num() > 0 || PartialWords.Num() > 0))
+	{
+		OnStreamUpdate.Broadcast(StreamId, CommittedWords, PartialWords);
+	}
+
+	if (bFinal)
+	{
+		// the state is freed with the stream
+		{
+			FScopeLock Lock(&DispatchSection);
+			LanguageCache.Remove(Stream->Slot.Request.Speaker);
+		}
+		Streams.Remove(StreamId);
+
+		UE_LOG(LogWhisper, Log, TEXT("Audio stream %d finished"), StreamId);
+		return;
+	}
+
+	// listeners could release the stream
+	StreamPtr = Streams.Find(StreamId);
+	if (StreamPtr && *StreamPtr == Stream)
+	{
+		TryStartStreamPass(Stream, Stream->bEnding);
+	}
 }
 
-void UWhisperSubsystem::AddRecognizedWord(FString Word, float Time1, float Time2)
+void UWhisperSubsystem::AddRecognizedWord(TArray<FSingeWordData>& RecognizedData, FString Word, float Time1, float Time2)
 {
 	static const TSet<FString> l_non_speech_tokens = {
 		TEXT("\""), TEXT("#"), TEXT("("), TEXT(")"), TEXT("*"), TEXT("+"), TEXT("/"), TEXT(":"), TEXT(";"), TEXT("<"), TEXT("="), TEXT(">"), TEXT("@"),
@@ -611,111 +2123,112 @@ void UWhisperSubsystem::AddRecognizedWord(FString Word, float Time1, float Time2
 void WhisperCallback::NewTextSegmentCallback(whisper_context* WhisperContext, whisper_state* WhisperState, int NewSegmentCount, void* UserData)
 {
 	if (!UserData) return;
-	UWhisperSubsystem* WhisperSubsystem = (UWhisperSubsystem*)UserData;
-	if (!WhisperSubsystem->WhisperContext || !WhisperSubsystem->WhisperParameters)
+	FWhisperStateSlot* Slot = (FWhisperStateSlot*)UserData;
+	if (!Slot->Owner)
 	{
 		return;
 	}
 
-	const int32 TotalSegmentCount = whisper_full_n_segments(WhisperContext);
+	const int32 TotalSegmentCount = whisper_full_n_segments_from_state(WhisperState);
 	const int32 StartIndex = TotalSegmentCount - NewSegmentCount;
 
 	FString NewData;
 	for (int32 Index = StartIndex; Index < TotalSegmentCount; ++Index)
 	{
-		const char* TextPerSegment = whisper_full_get_segment_text(WhisperContext, static_cast<int>(Index));
+		const char* TextPerSegment = whisper_full_get_segment_text_from_state(WhisperState, static_cast<int>(Index));
 		FString TextPerSegment_String = UTF8_TO_TCHAR(TextPerSegment);
 		NewData.Append(TextPerSegment_String);
 
-		// segment start and end
-		const int64_t t0 = whisper_full_get_segment_t0(WhisperSubsystem->WhisperContext, Index);
-		const int64_t t1 = whisper_full_get_segment_t1(WhisperSubsystem->WhisperContext, Index);
-
 		// token is a word
-		const int NumTokensInSegment = whisper_full_n_tokens(WhisperSubsystem->WhisperContext, Index);
+		const int NumTokensInSegment = whisper_full_n_tokens_from_state(WhisperState, Index);
 
 		for (int32 TokenIndex = 0; TokenIndex < NumTokensInSegment; TokenIndex++)
 		{
-			auto token = whisper_full_get_token_data(WhisperSubsystem->WhisperContext, Index, TokenIndex);
+			auto token = whisper_full_get_token_data_from_state(WhisperState, Index, TokenIndex);
 
-			const char* szTokenText = whisper_token_to_str(WhisperSubsystem->WhisperContext, token.id);
+			const char* szTokenText = whisper_token_to_str(WhisperContext, token.id);
 			FString TokenText = UTF8_TO_TCHAR(szTokenText);
 			TokenText.TrimStartAndEndInline();
 
 			float TimeStart = UWhisperSubsystem::AsSeconds(token.t0);
 			float TimeEnd = UWhisperSubsystem::AsSeconds(token.t1);
 
-			WhisperSubsystem->AddRecognizedWord(TokenText, TimeStart, TimeEnd);
+			UWhisperSubsystem::AddRecognizedWord(Slot->Request.Result.RecognizedData, TokenText, TimeStart, TimeEnd);
 		}
 	}
 
-	AsyncTask(ENamedThreads::GameThread, [WhisperSubsystem, NewData = MoveTemp(NewData)]() mutable
-		{
-			if (IsValid(WhisperSubsystem))
-			{
-				UE_LOG(LogWhisper, Log, TEXT("Recognized text segment: \"%s\""), *NewData);
-				WhisperSubsystem->RecognizedString.Append(NewData);
-			}
-		}
-	);
+	// the request is owned by this worker thread until it's completed, so no need to go to game thread
+	UE_LOG(LogWhisper, Log, TEXT("Recognized text segment (state %d): \"%s\""), Slot->Index, *NewData);
+	Slot->Request.Result.RecognizedString.Append(NewData);
 }
 
 bool WhisperCallback::EncoderBeginCallback(whisper_context* WhisperContext, whisper_state* WhisperState, void* UserData)
 {
 	if (!UserData) return false;
-	UWhisperSubsystem* WhisperSubsystem = (UWhisperSubsystem*)UserData;
-	if (!WhisperSubsystem->WhisperContext || !WhisperSubsystem->WhisperParameters)
+	FWhisperStateSlot* Slot = (FWhisperStateSlot*)UserData;
+	if (!Slot->Owner)
 	{
 		return false;
 	}
 
-	return true;
+	return !Slot->bBreakWork;
 }
 
 bool WhisperCallback::EncoderAbortCallback(void* UserData)
 {
 	if (!UserData) return true;
-	UWhisperSubsystem* WhisperSubsystem = (UWhisperSubsystem*)UserData;
-	if (!WhisperSubsystem->WhisperContext || !WhisperSubsystem->WhisperParameters)
+	FWhisperStateSlot* Slot = (FWhisperStateSlot*)UserData;
+	if (!Slot->Owner)
 	{
 		return true;
 	}
 	
-	return WhisperSubsystem->ShouldBreak();
+	return Slot->bBreakWork;
 }
 
 void WhisperCallback::ProgressCallback(whisper_context* WhisperContext, whisper_state* WhisperState, int Progress, void* UserData)
 {
 	if (!UserData) return;
-	UWhisperSubsystem* WhisperSubsystem = (UWhisperSubsystem*)UserData;
-	if (!WhisperSubsystem->WhisperContext || !WhisperSubsystem->WhisperParameters)
+	FWhisperStateSlot* Slot = (FWhisperStateSlot*)UserData;
+	if (!Slot->Owner)
 	{
 		return;
 	}
 
 	Progress = FMath::Clamp(Progress, 0, 100);
 
-	UE_LOG(LogWhisper, Log, TEXT("Speech recognition progress: %d"), Progress);
+	// results are sent to the sender in UWhisperSubsystem::OnRequestComplete
+	UE_LOG(LogWhisper, Log, TEXT("Speech recognition progress (state %d): %d"), Slot->Index, Progress);
+}
+
+bool WhisperCallback::ModelLoadProgressCallback(size_t BytesLoaded, size_t BytesTotal, int TensorsLoaded, int TensorsTotal, void* UserData)
+{
+	if (!UserData) return true;
+	FModelLoadUserData* Data = (FModelLoadUserData*)UserData;
 
-	if (Progress == 100)
+	// report every percent, not every tensor
+	const int32 Percent = BytesTotal > 0 ? (int32)(BytesLoaded * 100 / BytesTotal) : 100;
+	if (Percent == Data->LastPercent && TensorsLoaded < TensorsTotal)
 	{
-		AsyncTask(ENamedThreads::GameThread, [WhisperSubsystem, Progress]() mutable
-			{
-				if (IsValid(WhisperSubsystem->ActiveRequest.Sender))
-				{
-					WhisperSubsystem->RecognizedString.ReplaceInline(TEXT("  "), TEXT(" "));
-					WhisperSubsystem->RecognizedString.TrimStartAndEndInline();
-
-					WhisperSubsystem->ActiveRequest.Sender->OnExternalRecognizeResult(
-						WhisperSubsystem->ActiveRequest.Id,
-						WhisperSubsystem->ActiveRequest.Flag,
-						WhisperSubsystem->RecognizedString,
-						WhisperSubsystem->RecognizedData
-					);
-				}
-				WhisperSubsystem->RecognizeFromQueue();
-			}
-		);
+		return true;
 	}
+	Data->LastPercent = Percent;
+
+	FWhisperModelLoadProgress LoadProgress;
+	LoadProgress.BytesLoaded = (int64)BytesLoaded;
+	LoadProgress.BytesTotal = (int64)BytesTotal;
+	LoadProgress.TensorsLoaded = TensorsLoaded;
+	LoadProgress.TensorsTotal = TensorsTotal;
+	LoadProgress.Progress = BytesTotal > 0 ? (float)((double)BytesLoaded / (double)BytesTotal) : 1.f;
+
+	// false aborts loading
+	return Data->Subsystem->ReportModelLoadProgress(Data->Generation, LoadProgress);
+}
+
+bool WhisperCallback::WarmUpAbortCallback(void* UserData)
+{
+	if (!UserData) return true;
+	FModelLoadUserData* Data = (FModelLoadUserData*)UserData;
+	return Data->Subsystem->IsModelLoadAborted(Data->Generation);
 }
 
@@ -4,6 +4,9 @@
 #include "YnnkWhisperSettings.h"
 #include "Interfaces/IPluginManager.h"
 #include "Misc/Paths.h"
+#include "HAL/PlatformMisc.h"
+#include "Engine/Engine.h"
+#include "WhisperSubsystem.h"
 
 UYnnkWhisperSettings::UYnnkWhisperSettings()
 {
@@ -21,6 +24,37 @@ FString UYnnkWhisperSettings::GetModelPath() const
 	return Result;
 }
 
+int32 UYnnkWhisperSettings::GetNumThreads() const
+{
+	if (bUseAllPhysicalCores)
+	{
+		// all states work simultaneously, so share cores between them
+		return FMath::Max(1, FPlatformMisc::NumberOfCores() / FMath::Max(1, NumRecognitionStates));
+	}
+	return FMath::Max(1, NumThreads);
+}
+
+SIZE_T UYnnkWhisperSettings::GetEncoderCacheSize() const
+{
+	return (SIZE_T)FMath::Max(0, EncoderCacheSizeMB) * 1024 * 1024;
+}
+
+#if WITH_EDITOR
+void UYnnkWhisperSettings::PostEditChangeProperty(FPropertyChangedEvent& PropertyChangedEvent)
+{
+	Super::PostEditChangeProperty(PropertyChangedEvent);
+
+	// re-apply parameters to the loaded model
+	if (GEngine)
+	{
+		if (auto WhisperSubsystem = GEngine->GetEngineSubsystem<UWhisperSubsystem>())
+		{
+			WhisperSubsystem->ApplySettings();
+		}
+	}
+}
+#endif
+
 void UYnnkWhisperSettings::MakeFullPath(FString& InOutPath) const
 {
 	FString ContentDir;
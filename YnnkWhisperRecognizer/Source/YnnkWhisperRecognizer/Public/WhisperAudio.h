@@ -0,0 +1,93 @@
+// (c) Yuri N. K. 2024. All rights reserved.
+// ykasczc@gmail.com
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "DSP/AlignedBuffer.h"
+
+/**
+* Audio processing helpers used to prepare input audio for whisper (16 kHz, mono, 32bit float)
+*/
+namespace WhisperAudio
+{
+	/**
+	* Convert mono 16-bit PCM (as delivered by the recognizer interface) to float scaled to [-1, 1), vectorized
+	* @param InData input samples
+	* @param NumSamples number of samples
+	* @param OutData output buffer for NumSamples values
+	*/
+	YNNKWHISPERRECOGNIZER_API void ConvertPCM16ToFloat(const int16* InData, int32 NumSamples, float* OutData);
+
+	/**
+	* Polyphase decomposition of a Kaiser-windowed sinc low-pass filter for resampling by a rational ratio
+	* Interpolation / Decimation. Immutable after creation and shared between resamplers with the same rates.
+	*/
+	struct FPolyphaseFilterBank
+	{
+		int32 InputRate = 0;
+		int32 OutputRate = 0;
+
+		/** Upsampling factor L (OutputRate / gcd) */
+		int32 Interpolation = 1;
+
+		/** Downsampling factor M (InputRate / gcd) */
+		int32 Decimation = 1;
+
+		/** Filter length in input samples, multiple of 8 */
+		int32 TapsPerPhase = 0;
+
+		/** Interpolation x TapsPerPhase coefficients. Taps of every phase are stored reversed, so output sample is a plain dot product with input window */
+		TArray<float> Coefficients;
+
+		const float* GetPhase(int32 Phase) const { return Coefficients.GetData() + Phase * TapsPerPhase; }
+	};
+
+	/** Get filter bank for the rates from process-wide cache; created on first use. Thread safe. */
+	YNNKWHISPERRECOGNIZER_API TSharedPtr<const FPolyphaseFilterBank, ESPMode::ThreadSafe> GetPolyphaseFilterBank(int32 InputRate, int32 OutputRate);
+
+	/**
+	* Streaming polyphase resampler. Keeps tail of the previous chunk, so audio can be pushed in blocks of any size
+	* and the output is the same as resampling the whole signal at once.
+	*/
+	class YNNKWHISPERRECOGNIZER_API FPolyphaseResampler
+	{
+	public:
+		/** Prepare to resample from InputRate to OutputRate. Returns false if rates are invalid. */
+		bool Init(int32 InputRate, int32 OutputRate);
+
+		/** Drop buffered audio and start a new signal with the same rates */
+		void Reset();
+
+		bool IsInitialized() const { return FilterBank.IsValid(); }
+
+		/**
+		* Resample next block of input and append result to OutData.
+		* Output is delayed by half of the filter length, remaining samples are produced by Flush.
+		*/
+		void Process(const float* InData, int32 NumFrames, Audio::FAlignedFloatBuffer& OutData);
+
+		/** Finish the signal: append output for the buffered input tail and reset */
+		void Flush(Audio::FAlignedFloatBuffer& OutData);
+
+	private:
+		void ProcessBuffered(Audio::FAlignedFloatBuffer& OutData);
+
+		TSharedPtr<const FPolyphaseFilterBank, ESPMode::ThreadSafe> FilterBank;
+
+		/** Input samples which aren't fully consumed yet, starting with zero history */
+		TArray<float> History;
+
+		/** Index in History of the first sample of the next output window */
+		int32 Position = 0;
+
+		/** Filter phase of the next output sample */
+		int32 Phase = 0;
+	};
+
+	/**
+	* Resample the whole signal at once with FPolyphaseResampler filters, without copying input.
+	* OutData is resized to exactly ceil(NumFrames * OutputRate / InputRate) samples.
+	*/
+	YNNKWHISPERRECOGNIZER_API bool Resample(const float* InData, int32 NumFrames, int32 InputRate, int32 OutputRate, Audio::FAlignedFloatBuffer& OutData);
+}
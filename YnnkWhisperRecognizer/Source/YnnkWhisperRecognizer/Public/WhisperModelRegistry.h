@@ -0,0 +1,94 @@
+// (c) Yuri N. K. 2024. All rights reserved.
+// ykasczc@gmail.com
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+struct whisper_context;
+
+/**
+* Loaded whisper model: context created without state, i. e. immutable weights and vocabulary.
+* Shared by all users of the same model file or asset; every user creates its own whisper states.
+* The context is freed with the last reference.
+*/
+struct YNNKWHISPERRECOGNIZER_API FWhisperModel
+{
+	FWhisperModel(const FString& InKey, uint64 InVersion, whisper_context* InContext, TFunction<void()>&& InOnReleased);
+	~FWhisperModel();
+
+	FWhisperModel(const FWhisperModel&) = delete;
+	FWhisperModel& operator=(const FWhisperModel&) = delete;
+
+	/** Registry key: full path of the model file or path of the model asset */
+	const FString Key;
+
+	/** Version of the source the model was loaded from: hash of file timestamp and size, or hash of the asset payload (0 if not hashed) */
+	const uint64 Version;
+
+	/** Whisper context without state */
+	whisper_context* const Context;
+
+private:
+	/** Called on game thread after the context is freed, i. e. to release memory used by the context in place */
+	TFunction<void()> OnReleased;
+};
+
+typedef TSharedPtr<FWhisperModel, ESPMode::ThreadSafe> FWhisperModelPtr;
+
+/**
+* Process-wide registry of loaded whisper models. Holds weak references, so a model is released as soon
+* as the last user drops it, and loading the same model again while it's in use doesn't duplicate weights.
+* Models being loaded are registered as pending, so other users wait for them instead of loading them again.
+* Thread safe.
+*/
+class YNNKWHISPERRECOGNIZER_API FWhisperModelRegistry
+{
+public:
+	static FWhisperModelRegistry& Get();
+
+	/** Find model which is loaded and used now */
+	FWhisperModelPtr Find(const FString& Key);
+
+	/**
+	* Find loaded model or wait while it's loaded by another user. Called on loading thread.
+	* If the model isn't loaded or being loaded, returns nullptr with bOutShouldLoad set: the caller is
+	* registered as the pending loader and must call Register or CancelLoad.
+	* @param Key full path of the model file or path of the model asset
+	* @param IsAborted checked while waiting; if it returns true, nullptr is returned and bOutShouldLoad isn't set
+	*/
+	FWhisperModelPtr FindOrWait(const FString& Key, TFunctionRef<bool()> IsAborted, bool& bOutShouldLoad);
+
+	/** Remove pending load registered by FindOrWait when the model can't be loaded (waiting users try to load it themselves) */
+	void CancelLoad(const FString& Key);
+
+	/**
+	* Register newly loaded model and finish its pending load. If the same model was registered meanwhile
+	* by another thread, the new context is freed (with OnReleased) and the existing model is returned.
+	* @param Key full path of the model file or path of the model asset
+	* @param Version version of the model source (see FWhisperModel::Version)
+	* @param Context whisper context without state; owned by the registered model
+	* @param OnReleased optional function called on game thread after the context is freed
+	*/
+	FWhisperModelPtr Register(const FString& Key, uint64 Version, whisper_context* Context, TFunction<void()>&& OnReleased = nullptr);
+
+	/** Number of models in use */
+	int32 Num();
+
+private:
+	/** Model being loaded; waiting users are woken up when it's registered or cancelled */
+	struct FPendingLoad
+	{
+		FPendingLoad();
+		~FPendingLoad();
+
+		FEvent* Event;
+	};
+
+	/** Wake up users waiting for the pending load. Call under Section. */
+	void FinishLoad(const FString& Key);
+
+	FCriticalSection Section;
+	TMap<FString, TWeakPtr<FWhisperModel, ESPMode::ThreadSafe>> Models;
+	TMap<FString, TSharedPtr<FPendingLoad, ESPMode::ThreadSafe>> PendingLoads;
+};
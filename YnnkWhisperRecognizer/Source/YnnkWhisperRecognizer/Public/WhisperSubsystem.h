@@ -5,8 +5,10 @@
 
 #include "CoreMinimal.h"
 #include "Subsystems/EngineSubsystem.h"
-#include "Containers/Queue.h"
+#include "Containers/LockFreeList.h"
 #include "DSP/AlignedBuffer.h"
+#include "WhisperAudio.h"
+#include "WhisperModelRegistry.h"
 #include "HAL/ThreadSafeBool.h"
 #include <atomic>
 #include "ExternalRecognizerInterface.h"
@@ -17,6 +19,43 @@ DECLARE_LOG_CATEGORY_EXTERN(LogWhisper, Log, All);
 
 class UAsyncRecognizer;
 
+/** Priority class of recognition requests: queued requests of a higher class are always started first */
+UENUM(BlueprintType)
+enum class EWhisperRequestPriority : uint8
+{
+	Interactive			UMETA(DisplayName = "Interactive"),
+	Normal				UMETA(DisplayName = "Normal"),
+	Batch				UMETA(DisplayName = "Batch"),
+	Num					UMETA(Hidden)
+};
+
+/**
+* Output of a single recognition request. Filled by whisper callbacks on the worker thread
+* processing the request and moved back to the game thread when the request is completed.
+*/
+USTRUCT(BlueprintType)
+struct YNNKWHISPERRECOGNIZER_API FWhisperResult
+{
+	GENERATED_BODY()
+
+	/** Clean subtitles */
+	FString RecognizedString;
+
+	/** Recognized words with time marks */
+	TArray<FSingeWordData> RecognizedData;
+};
+
+/** Part of the original audio kept in the recognized buffer after voice activity detection (seconds) */
+struct FWhisperTimeSpan
+{
+	/** Start of the part in the recognized buffer */
+	float BufferTime = 0.f;
+	/** Start of the part in the original audio */
+	float OriginalTime = 0.f;
+	/** Length of the part */
+	float Duration = 0.f;
+};
+
 /**
 * Struct to store recognition requests in the queue.
 * In fact, I don't expect the queue is needed, because requests are processed one by one
@@ -27,8 +66,8 @@ struct YNNKWHISPERRECOGNIZER_API FWhisperRequest
 {
 	GENERATED_BODY()
 
-	/** Request sender, i. e. pointer to UAsyncRecognizer object from YnnkVoiceLipsync */
-	TObjectPtr<UAsyncRecognizer> Sender = nullptr;
+	/** Request sender, i. e. UAsyncRecognizer object from YnnkVoiceLipsync; can be destroyed while the request is processed */
+	TWeakObjectPtr<UAsyncRecognizer> Sender;
 
 	/** Request Id, just need to return it */
 	int32 Id = INDEX_NONE;
@@ -36,10 +75,178 @@ struct YNNKWHISPERRECOGNIZER_API FWhisperRequest
 	/** Request flag, just need to return it */
 	uint8 Flag = 0;
 
+	/** Priority class in the queue */
+	EWhisperRequestPriority Priority = EWhisperRequestPriority::Normal;
+
+	/** Sequential number of the request, used to check if it was cancelled after it was queued */
+	uint32 Serial = 0;
+
+	/** Key of the language detected for the request in UWhisperSubsystem::LanguageCache: speaker of the sender or the sender itself */
+	FName Speaker;
+
+	/** Key of the request result in the transcription cache on disk; empty if the cache is disabled */
+	FString TranscriptionKey;
+
 	/** Audio data (16,000 Hz, mono, 32bit) */
 	Audio::FAlignedFloatBuffer AudioBuffer;
+
+	/** Voiced parts of the original audio kept in AudioBuffer. Empty if silence wasn't removed. */
+	TArray<FWhisperTimeSpan> TimeMap;
+
+	/** Recognition result accumulated while the request is processed */
+	FWhisperResult Result;
+};
+
+/** Language detected for a sender, speaker or live stream */
+struct FWhisperLanguageInfo
+{
+	/** Whisper language id */
+	int32 LangId = INDEX_NONE;
+
+	/** Probability of the detected language followed by average probability of tokens recognized in this language */
+	float Confidence = 0.f;
 };
 
+/**
+* Single whisper_state from the pool. All states share one loaded model (WhisperContext),
+* but each of them can process its own recognition request.
+* Slots are shared with recognition tasks, so a released slot is freed when its last task is finished.
+*/
+struct FWhisperStateSlot
+{
+	FWhisperStateSlot() = default;
+	/** Frees State */
+	~FWhisperStateSlot();
+
+	FWhisperStateSlot(const FWhisperStateSlot&) = delete;
+	FWhisperStateSlot& operator=(const FWhisperStateSlot&) = delete;
+
+	/** Owning subsystem */
+	class UWhisperSubsystem* Owner = nullptr;
+
+	/** Index of the slot in UWhisperSubsystem::StateSlots */
+	int32 Index = INDEX_NONE;
+
+	/** Model of the state; kept by the slot, so the model can't be freed before the state */
+	FWhisperModelPtr Model;
+
+	/** Whisper state created with whisper_init_state */
+	struct whisper_state* State = nullptr;
+
+	/** Request currently processed with this state; owns its result until it's moved back to the game thread */
+	FWhisperRequest Request;
+
+	/** Sender and Id of the current request to cancel it. Guarded by UWhisperSubsystem::DispatchSection. */
+	TWeakObjectPtr<UAsyncRecognizer> RequestSender;
+	int32 RequestId = INDEX_NONE;
+
+	/** Is the state processing a request now? Guarded by UWhisperSubsystem::DispatchSection (stream slots: game thread only). */
+	bool bBusy = false;
+
+	/** Set by StopRecognition_Implementation to interupt current request */
+	FThreadSafeBool bBreakWork = false;
+};
+
+typedef TSharedPtr<FWhisperStateSlot, ESPMode::ThreadSafe> FWhisperStateSlotPtr;
+
+/**
+* Multi-producer multi-consumer lock-free queue of recognition requests with a FIFO per priority class.
+* Requests are stored by pointer, so enqueueing never blocks and never moves other requests.
+*/
+class YNNKWHISPERRECOGNIZER_API FWhisperRequestQueue
+{
+public:
+	~FWhisperRequestQueue() { Empty(); }
+
+	/** Add request to the end of its priority class. Can be called from any thread. */
+	void Enqueue(FWhisperRequest&& Request);
+
+	/** Get the oldest request of the highest priority class. Can be called from any thread. */
+	bool Dequeue(FWhisperRequest& OutRequest);
+
+	bool IsEmpty() const;
+
+	/** Remove all requests */
+	void Empty();
+
+private:
+	TLockFreePointerListFIFO<FWhisperRequest, PLATFORM_CACHE_LINE_SIZE> Queues[(int32)EWhisperRequestPriority::Num];
+};
+
+/**
+* Live audio stream recognized with a sliding window (see UWhisperSubsystem::BeginStream).
+* Every stream has its own whisper state, so it doesn't block requests from the queue.
+* Streams are shared with their recognition passes, so a released stream is freed when its pass is finished.
+*/
+struct FWhisperStream
+{
+	/** Id returned by BeginStream */
+	int32 StreamId = INDEX_NONE;
+
+	/** Sample rate of pushed audio */
+	int32 SampleRate = 16000;
+
+	/** Converts pushed audio to 16 kHz if SampleRate is different */
+	WhisperAudio::FPolyphaseResampler Resampler;
+
+	/** Whisper state with streaming mel spectrogram, abort flag and words recognized by the current pass */
+	FWhisperStateSlot Slot;
+
+	/** 16 kHz audio pushed since the last pass was started. Only accessed from the game thread. */
+	Audio::FAlignedFloatBuffer PendingAudio;
+
+	/** EndStream was called: run the final pass and release the stream */
+	bool bEnding = false;
+
+	/** End of the last committed word (seconds from the beginning of the stream). Only accessed by recognition pass. */
+	float CommittedTime = 0.f;
+
+	/** Uncommitted words recognized by the previous pass. Only accessed by recognition pass. */
+	TArray<FSingeWordData> Hypothesis;
+};
+
+typedef TSharedPtr<FWhisperStream, ESPMode::ThreadSafe> FWhisperStreamPtr;
+
+/**
+* Called on game thread after every recognition pass over a live audio stream.
+* CommittedWords are new words which won't change anymore; PartialWords follow them and can be revised by the next passes.
+* Time marks are in seconds from the beginning of the stream.
+*/
+DECLARE_DYNAMIC_MULTICAST_DELEGATE_ThreeParams(FWhisperStreamUpdateSignature, int32, StreamId, const TArray<FSingeWordData>&, CommittedWords, const TArray<FSingeWordData>&, PartialWords);
+
+/** Progress of model loading started with LoadModelFromFile or LoadModelFromAsset */
+USTRUCT(BlueprintType)
+struct YNNKWHISPERRECOGNIZER_API FWhisperModelLoadProgress
+{
+	GENERATED_BODY()
+
+	/** Size of loaded weights (bytes) */
+	UPROPERTY(BlueprintReadOnly, Category = "Whisper")
+	int64 BytesLoaded = 0;
+
+	/** Size of all weights of the model (bytes) */
+	UPROPERTY(BlueprintReadOnly, Category = "Whisper")
+	int64 BytesTotal = 0;
+
+	/** Number of loaded tensors */
+	UPROPERTY(BlueprintReadOnly, Category = "Whisper")
+	int32 TensorsLoaded = 0;
+
+	/** Number of tensors in the model */
+	UPROPERTY(BlueprintReadOnly, Category = "Whisper")
+	int32 TensorsTotal = 0;
+
+	/** Loaded part of the model, 0..1 */
+	UPROPERTY(BlueprintReadOnly, Category = "Whisper")
+	float Progress = 0.f;
+};
+
+/** Called on game thread while the model is loading */
+DECLARE_DYNAMIC_MULTICAST_DELEGATE_OneParam(FWhisperModelLoadProgressSignature, const FWhisperModelLoadProgress&, LoadProgress);
+
+/** Called on game thread when the model is loaded and ready to use (bSuccess = true) or failed to load */
+DECLARE_DYNAMIC_MULTICAST_DELEGATE_OneParam(FWhisperModelLoadedSignature, bool, bSuccess);
+
 /**
  * Engine subsystem-wrapper for whisper.cpp voice recognition library 
  */
@@ -57,11 +264,20 @@ public:
 	/** init whisper_full_params */
 	void InitializeParameters();
 
+	/**
+	* Apply threads and decoding parameters from UYnnkWhisperSettings to whisper_full_params.
+	* Can be called at any time, new parameters are used for the next recognition requests.
+	*/
+	UFUNCTION(BlueprintCallable, Category = "Whisper")
+	void ApplySettings();
+
 	/** Free memory */
 	void ReleaseWhisper();
 
-	/** The Whisper context used for speech recognition */
+	/** The Whisper context used for speech recognition (model only, without state). Can be shared with other users of the same model. */
 	struct whisper_context* WhisperContext;
+	/** Pool of whisper states sharing WhisperContext; each one processes a single request at a time */
+	TArray<FWhisperStateSlotPtr> StateSlots;
 	/** The parameters used for configuring the Whisper speech recognizer */
 	struct whisper_full_params* WhisperParameters;
 
@@ -69,14 +285,6 @@ public:
 	UPROPERTY()
 	FString Language = TEXT("en");
 
-	/** Output result: clean subtitles */
-	UPROPERTY()
-	FString RecognizedString;
-
-	/** Output result: recognized words with time marks */
-	UPROPERTY()
-	TArray<FSingeWordData> RecognizedData;
-
 	// Debug function; should delete
 	UFUNCTION(BlueprintPure, Category = "Whisper")
 	void IterateDirectory(const FString& Dir, TArray<FString>& Data);
@@ -95,6 +303,7 @@ public:
 	* @param FileName full name of .bin file
 	* @param bAutoBind automatically bind Whisper module to YnnkVoiceLipsync as primary voice recognition toolkit (no need to call BindWhisper)
 	* @param bForceReinitialize load model if whisper was already initialized
+	* Model is loaded in background: progress is reported with OnModelLoadProgress, result with OnModelLoaded.
 	*/
 	UFUNCTION(BlueprintCallable, Category = "Whisper")
 	void LoadModelFromFile(const FString& FileName, bool bAutoBind = true, bool bForceReinitialize = false);
@@ -104,26 +313,124 @@ public:
 	* @param Archive BinaryArchive asset with binary ggml model
 	* @param bAutoBind automatically bind Whisper module to YnnkVoiceLipsync as primary voice recognition toolkit (no need to call BindWhisper)
 	* @param bForceReinitialize load model if whisper was already initialized
+	* Model is loaded in background: progress is reported with OnModelLoadProgress, result with OnModelLoaded.
 	*/
 	UFUNCTION(BlueprintCallable, Category = "Whisper")
 	void LoadModelFromAsset(TSoftObjectPtr<class UZipUFSArchive> Archive, bool bAutoBind = true, bool bForceReinitialize = false);
 
-	/** Debug function processing direct requests, currently shouldn't be used because result output isn't implemented */
+	/** Is the model being loaded now? */
+	UFUNCTION(BlueprintPure, Category = "Whisper")
+	bool IsModelLoading() const { return bModelLoading; }
+
+	/** Progress of the last model loading */
+	UFUNCTION(BlueprintPure, Category = "Whisper")
+	FWhisperModelLoadProgress GetModelLoadProgress() const { return ModelLoadProgress; }
+
+	/** Duration of the warm-up pass after the last model loading (seconds), 0 if warm-up is disabled */
+	UFUNCTION(BlueprintPure, Category = "Whisper")
+	float GetModelWarmUpTime() const { return ModelWarmUpTime; }
+
+	/** Called while the model is loading, at most once per percent */
+	UPROPERTY(BlueprintAssignable, Category = "Whisper")
+	FWhisperModelLoadProgressSignature OnModelLoadProgress;
+
+	/** Called when LoadModelFromFile or LoadModelFromAsset is finished; also called if the model was already loaded */
+	UPROPERTY(BlueprintAssignable, Category = "Whisper")
+	FWhisperModelLoadedSignature OnModelLoaded;
+
+	/** Internal function called on loading thread to report progress (once per percent). Returns false if loading should be aborted. */
+	bool ReportModelLoadProgress(int32 Generation, const FWhisperModelLoadProgress& LoadProgress);
+	/** Internal function: was the model load with this generation aborted or replaced by another load? */
+	bool IsModelLoadAborted(int32 Generation) const { return Generation != LoadGeneration; }
+
+	/** Debug function processing direct requests, currently shouldn't be used because result output isn't implemented (result is only logged) */
 	UFUNCTION(BlueprintCallable, Category = "Whisper")
 	void RecognizeAudio(const TArray<float>& AudioDataF32);
 
+	/**
+	* Start recognition of live audio (i. e. microphone input). Audio pushed with PushStreamAudio is recognized
+	* every UYnnkWhisperSettings::StreamStepMs with a sliding window, results are reported with OnStreamUpdate.
+	* @param SampleRate sample rate of audio which will be pushed to the stream
+	* @return Id of the new stream or INDEX_NONE if the model isn't loaded
+	*/
+	UFUNCTION(BlueprintCallable, Category = "Whisper|Streaming")
+	int32 BeginStream(int32 SampleRate = 16000);
+
+	/**
+	* Add audio (mono, 32bit float) to the live stream. Can be called from any thread,
+	* i. e. directly from audio capture callback.
+	*/
+	UFUNCTION(BlueprintCallable, Category = "Whisper|Streaming")
+	void PushStreamAudio(int32 StreamId, const TArray<float>& PCMData);
+
+	/** Recognize the rest of the stream, commit all words and release the stream */
+	UFUNCTION(BlueprintCallable, Category = "Whisper|Streaming")
+	void EndStream(int32 StreamId);
+
+	/** Is stream with this Id started and not finished yet? */
+	UFUNCTION(BlueprintPure, Category = "Whisper|Streaming")
+	bool IsStreamActive(int32 StreamId) const;
+
+	/** Called when live stream has new recognized words */
+	UPROPERTY(BlueprintAssignable, Category = "Whisper|Streaming")
+	FWhisperStreamUpdateSignature OnStreamUpdate;
+
+	/**
+	* Set priority class of all future requests from the sender. For example, interactive dialogue lines can be
+	* recognized before lines processed in background.
+	*/
+	UFUNCTION(BlueprintCallable, Category = "Whisper")
+	void SetSenderPriority(UAsyncRecognizer* Sender, EWhisperRequestPriority Priority);
+
+	/**
+	* Set speaker of all future requests from the sender. If language is "auto", detected language is cached per speaker,
+	* so senders recognizing the same person share it. By default every sender is a speaker itself.
+	* @param Speaker speaker name; None to reset
+	*/
+	UFUNCTION(BlueprintCallable, Category = "Whisper|Language")
+	void SetSenderSpeaker(UAsyncRecognizer* Sender, FName Speaker);
+
+	/**
+	* Get language detected for the sender (or its speaker) by the last requests.
+	* @return false if the language wasn't detected yet
+	*/
+	UFUNCTION(BlueprintCallable, Category = "Whisper|Language")
+	bool GetSenderLanguage(UAsyncRecognizer* Sender, FString& OutLanguage, float& OutConfidence);
+
+	/** Forget all detected languages, so they are detected again by the next requests */
+	UFUNCTION(BlueprintCallable, Category = "Whisper|Language")
+	void ClearLanguageCache();
+
+	/**
+	* Cancel queued and running requests. Requests of other senders aren't affected.
+	* @param Sender sender of requests to cancel; nullptr to cancel all requests
+	* @param Id Id of the request to cancel; INDEX_NONE to cancel all requests of the Sender
+	*/
+	UFUNCTION(BlueprintCallable, Category = "Whisper")
+	void CancelRequests(UAsyncRecognizer* Sender, int32 Id = -1);
+
 	/** Is WhisperSubsytem ready to use? */
 	UFUNCTION(BlueprintPure, Category = "Whisper")
 	bool IsInitialized() const;
 
-	/** Internal function to recognize next audio from the RequestsQueue */
+	/** Number of whisper states in the pool, i. e. how many requests can be processed simultaneously */
+	UFUNCTION(BlueprintPure, Category = "Whisper")
+	int32 GetNumRecognitionStates() const { return StateSlots.Num(); }
+
+	/** Internal function to recognize next audio from the RequestsQueue with all free whisper states. Can be called from any thread. */
 	void RecognizeFromQueue();
 
-	/** Internal function to interrupt current recognition request */
-	bool ShouldBreak() { return bBreakWork; }
+	/** Internal function called on game thread to send result of the completed request to its sender */
+	void OnRequestComplete(FWhisperRequest&& Request, bool bSuccess);
 
-	/** Add new token to RecognizedData array */
-	void AddRecognizedWord(FString Word, float Time1, float Time2);
+	/** Remove silence from the request audio if voice activity detection is enabled in UYnnkWhisperSettings */
+	static void ApplyVoiceActivityDetection(FWhisperRequest& Request);
+
+	/** Convert time marks of recognized words from the trimmed audio back to the original audio */
+	static void RestoreOriginalTime(FWhisperRequest& Request);
+
+	/** Add new token to RecognizedData array of the request result */
+	static void AddRecognizedWord(TArray<FSingeWordData>& RecognizedData, FString Word, float Time1, float Time2);
 
 	/** Convert time mark to string timestamp hh:mm:ss:msec */
 	static FString AsTimestamp(int64_t t);
@@ -142,22 +449,135 @@ public:
 	virtual void GenerateCurves_Implementation(UAsyncRecognizer* Sender, const FYnnkGenerateRequestContext& Context) override {};
 	/* ~End IExternalRecognizerInterface interface */
 
-	/** Queue containing future requests for voice recognition */
-	TQueue<FWhisperRequest> RequestsQueue;
-	/** Currently executed recognition request */
-	FWhisperRequest ActiveRequest;
+	/** Queue containing future requests for voice recognition. Filled by ingest tasks, dequeued by RecognizeFromQueue. */
+	FWhisperRequestQueue RequestsQueue;
 
 protected:
-	/** Temp variable to resample input data (supports any sample rate and bit rate = 16 on input) */
-	FWhisperRequest TempRequest;
+	/**
+	* Resample request audio to 16 kHz (if needed), remove silence and add it to the queue.
+	* Everything is done on a worker thread, so the game thread is only involved to receive the result.
+	*/
+	void IngestRequest(FWhisperRequest&& Request, int32 SampleRate);
+
+	/** Guards StateSlots ownership, cancelled requests and WhisperParameters changes */
+	FCriticalSection DispatchSection;
+
+	/** Incremented by ReleaseWhisper to drop requests which are still in ingest tasks */
+	std::atomic<int32> IngestGeneration { 0 };
+
+	/** Number of requests in ingest tasks, i. e. not queued yet; the subsystem can't be destroyed until they are finished */
+	std::atomic<int32> NumIngestedRequests { 0 };
+
+	/** Number of tasks processing requests on worker threads; the subsystem can't be destroyed until they are finished */
+	std::atomic<int32> NumRunningTasks { 0 };
+
+	/** Last FWhisperRequest::Serial */
+	std::atomic<uint32> LastRequestSerial { 0 };
+
+	/** Priority classes set with SetSenderPriority. Only accessed from the game thread. */
+	TMap<TWeakObjectPtr<UAsyncRecognizer>, EWhisperRequestPriority> SenderPriorities;
+
+	/**
+	* Requests with Serial not greater than the value are cancelled: all requests, by sender and by sender and Id. Guarded by DispatchSection.
+	* Senders are weak pointers, so a new sender created at the address of a destroyed one isn't cancelled.
+	*/
+	uint32 CancelledSerial = 0;
+	TMap<TWeakObjectPtr<UAsyncRecognizer>, uint32> CancelledSenders;
+	TMap<TPair<TWeakObjectPtr<UAsyncRecognizer>, int32>, uint32> CancelledRequests;
+
+	/** Speakers set with SetSenderSpeaker. Only accessed from the game thread. */
+	TMap<TWeakObjectPtr<UAsyncRecognizer>, FName> SenderSpeakers;
+
+	/** Languages detected for speakers (see FWhisperRequest::Speaker). Guarded by DispatchSection. */
+	TMap<FName, FWhisperLanguageInfo> LanguageCache;
+
+	/** Key of the sender in LanguageCache: its speaker or unique name of the sender. Game thread only. */
+	FName GetSpeakerKey(UAsyncRecognizer* Sender) const;
+	/**
+	* Use language cached for the speaker if language is "auto" and the cached one is confident enough.
+	* Call under DispatchSection. Returns true if Params.language was changed.
+	*/
+	bool ApplyCachedLanguage(FName Speaker, struct whisper_full_params& Params) const;
+	/**
+	* Update language cache after successful recognition: cache detected language or update confidence of the cached one
+	* with average probability of recognized tokens. Called on worker thread.
+	*/
+	void UpdateLanguageCache(FName Speaker, struct whisper_context* Context, struct whisper_state* State, bool bCachedLanguage);
+
+	/** Identity of the loaded model in transcription keys. Guarded by DispatchSection. */
+	FString ModelIdentity;
+	/**
+	* Key of the request result in the transcription cache: hash of the request audio (before resampling and
+	* voice activity detection), the model and all settings affecting the result. Empty if the cache is disabled.
+	*/
+	FString GetTranscriptionKey(const FWhisperRequest& Request, int32 SampleRate);
+
+	/** Fill sender, Id, flag, priority, serial number and speaker of a new request */
+	void InitRequest(FWhisperRequest& Request, UAsyncRecognizer* Sender, int32 Id, uint8 Flag);
+	/** Was the request cancelled after it had been created? Call under DispatchSection. */
+	bool IsRequestCancelled(const FWhisperRequest& Request) const;
+
+	/** Loaded model shared through FWhisperModelRegistry; WhisperContext is its context. Set under DispatchSection. */
+	FWhisperModelPtr Model;
+	/**
+	* Publish loaded model with its whisper states and set bReady, unless the load is aborted (then returns false).
+	* Called on loading thread.
+	*/
+	bool UseModel(int32 Generation, FWhisperModelPtr&& InModel, TArray<FWhisperStateSlotPtr>&& InSlots);
+	/**
+	* Find the model in FWhisperModelRegistry or wait while it's loaded by another user. Returns false if the load is
+	* aborted; otherwise OutModel is the shared model, or nullptr if the caller should load and register it.
+	*/
+	bool WaitForSharedModel(int32 Generation, const FString& ModelKey, FWhisperModelPtr& OutModel);
+
+	/** Incremented when model loading is started or the model is released; outdated loads are aborted */
+	std::atomic<int32> LoadGeneration{0};
+	/** Is model loading in progress? Game thread only. */
+	bool bModelLoading = false;
+	/** Progress of the current model loading. Game thread only. */
+	FWhisperModelLoadProgress ModelLoadProgress;
+	/** Start new model loading: abort the previous one and reset progress. Returns generation of the new load. */
+	int32 BeginModelLoad();
+	/** Number of model loading tasks (including warm-up); the subsystem can't be destroyed until they are finished */
+	std::atomic<int32> NumLoadingTasks { 0 };
+	/** Run model loading task on worker thread, counted in NumLoadingTasks */
+	void StartLoadTask(TUniqueFunction<void()>&& Task);
+	/** Create states for the loaded model and report result on game thread. Called on loading thread. */
+	void FinishModelLoad(int32 Generation, FWhisperModelPtr&& LoadedModel, bool bAutoBind);
+	/**
+	* Recognize silence with every whisper state if UYnnkWhisperSettings::bWarmUpModel is set, so compute buffers are
+	* allocated and weights are paged in before the first request. Called on loading thread before the states are published.
+	*/
+	void WarmUpStates(int32 Generation, const TArray<FWhisperStateSlotPtr>& Slots);
+	/** Duration of the last warm-up (seconds) */
+	float ModelWarmUpTime = 0.f;
+	/** Finish model loading on game thread: bind whisper and broadcast OnModelLoaded. Can be called from any thread. */
+	void NotifyModelLoaded(int32 Generation, bool bSuccess, bool bAutoBind);
 
-	/** Resample (if needed) TempRequest and start recognition */
-	void ResampleTempBuffer(int32 DataSampleRate);
 	/** Called internally after loading model to bind to YnnkVoiceLipsync */
 	void OnModelReady();
-
-	/** Set by StopRecognition_Implementation to interupt current requests */
-	FThreadSafeBool bBreakWork = false;
+	/** Create pool of whisper states for the loaded model */
+	bool InitializeStates(const FWhisperModelPtr& InModel, TArray<FWhisperStateSlotPtr>& OutSlots);
+	/**
+	* Audio context (in encoder frames) for recognition of NumSamples of 16 kHz audio: adaptive if enabled in
+	* UYnnkWhisperSettings, otherwise DefaultAudioContext. Compute buffers of whisper states are measured with
+	* the full context of the model, so they fit any context.
+	*/
+	int32 GetAudioContext(struct whisper_context* Context, int32 NumSamples, int32 DefaultAudioContext) const;
+	/** Find whisper state which doesn't process any request now */
+	FWhisperStateSlotPtr FindFreeSlot() const;
+
+	/** Active live audio streams */
+	TMap<int32, FWhisperStreamPtr> Streams;
+	/** Last Id returned by BeginStream */
+	int32 LastStreamId = 0;
+
+	/** Start recognition pass over the stream window if the stream has enough new audio (or if bFinal is set) */
+	void TryStartStreamPass(const FWhisperStreamPtr& Stream, bool bFinal = false);
+	/** Called on game thread when a recognition pass over the stream is finished */
+	void OnStreamPassComplete(int32 StreamId, const FWhisperStreamPtr& Stream, TArray<FSingeWordData>&& CommittedWords, TArray<FSingeWordData>&& PartialWords, bool bSuccess, bool bFinal);
+	/** Split words of the last stream pass into committed and partial ones. Called on worker thread. */
+	static void UpdateStreamHypothesis(FWhisperStream& Stream, float WindowStart, float WindowLength, bool bWindowFull, bool bFinal, TArray<FSingeWordData>& OutCommitted, TArray<FSingeWordData>& OutPartial);
 	/** Set when the whisper is ready to use */
 	FThreadSafeBool bReady = false;
 };
@@ -6,6 +6,24 @@
 #include "CoreMinimal.h"
 #include "YnnkWhisperSettings.generated.h"
 
+/** Decoding strategy, see whisper_sampling_strategy */
+UENUM(BlueprintType)
+enum class EWhisperSamplingStrategy : uint8
+{
+	Greedy				UMETA(DisplayName = "Greedy"),
+	BeamSearch			UMETA(DisplayName = "Beam Search")
+};
+
+/** Precision of model weights quantized on load */
+UENUM(BlueprintType)
+enum class EWhisperQuantization : uint8
+{
+	None				UMETA(DisplayName = "None (use model file)"),
+	Q8_0				UMETA(DisplayName = "Q8_0 (8 bit)"),
+	Q5_1				UMETA(DisplayName = "Q5_1 (5 bit)"),
+	Q4_0				UMETA(DisplayName = "Q4_0 (4 bit)")
+};
+
 /**
 * Settings object for YnnkWhisperRecognizer plugin
 */
@@ -20,6 +38,16 @@ public:
 	// Get finalized path to the model file, generated from DefaultModelFilePath
 	FString GetModelPath() const;
 
+	// Get number of computation threads for a single whisper state
+	int32 GetNumThreads() const;
+
+	// Get memory budget of the encoder cache in bytes
+	SIZE_T GetEncoderCacheSize() const;
+
+#if WITH_EDITOR
+	virtual void PostEditChangeProperty(FPropertyChangedEvent& PropertyChangedEvent) override;
+#endif
+
 	/**
 	* Path to whisper voice recognition model, relative to Content folder
 	* You can download trained models here: https://huggingface.co/ggerganov/whisper.cpp/tree/main
@@ -27,6 +55,171 @@ public:
 	*/
 	UPROPERTY(GlobalConfig, EditAnywhere, Category = "General")
 	FString DefaultModelFilePath = TEXT("Whisper/ggml-tiny.bin");
+
+	/**
+	* Number of whisper states sharing the loaded model. Each state processes one recognition request,
+	* so this is a number of requests which can be recognized simultaneously.
+	* Every state allocates its own KV caches and compute buffers, so memory usage grows with this value.
+	*/
+	UPROPERTY(GlobalConfig, EditAnywhere, Category = "Performance", meta = (ClampMin = "1", ClampMax = "64", UIMin = "1", UIMax = "16"))
+	int32 NumRecognitionStates = 1;
+
+	/** Use all physical CPU cores for recognition (split between recognition states). If set, NumThreads is ignored. */
+	UPROPERTY(GlobalConfig, EditAnywhere, Category = "Performance")
+	bool bUseAllPhysicalCores = false;
+
+	/** Number of computation threads used by every recognition state */
+	UPROPERTY(GlobalConfig, EditAnywhere, Category = "Performance", meta = (EditCondition = "!bUseAllPhysicalCores", ClampMin = "1", ClampMax = "64", UIMin = "1", UIMax = "16"))
+	int32 NumThreads = 4;
+
+	/**
+	* Size of audio context (in encoder frames, 1500 = 30 seconds). Smaller values make encoder faster, but
+	* audio longer than context would be cut. 0 = use full context of the model.
+	*/
+	UPROPERTY(GlobalConfig, EditAnywhere, Category = "Performance", meta = (ClampMin = "0", ClampMax = "1500"))
+	int32 AudioContext = 0;
+
+	/**
+	* Choose audio context for every request from the length of its audio (after voice activity detection)
+	* plus AudioContextMargin, so short clips are encoded much faster: encoder cost grows quadratically with the context.
+	* AudioContext (if not 0) is the upper limit. Also applies to passes over live audio streams.
+	* The model was trained on full 30-second context only: reduced context degrades accuracy and can make whisper
+	* repeat or hallucinate text, so check recognition quality before enabling it.
+	*/
+	UPROPERTY(GlobalConfig, EditAnywhere, Category = "Performance")
+	bool bAdaptiveAudioContext = false;
+
+	/** Audio context added to the length of audio with bAdaptiveAudioContext (ms) */
+	UPROPERTY(GlobalConfig, EditAnywhere, Category = "Performance", meta = (EditCondition = "bAdaptiveAudioContext", ClampMin = "0", ClampMax = "10000"))
+	int32 AudioContextMarginMs = 1000;
+
+	/**
+	* Map model file to memory when it's loaded with LoadModelFromFile. Weights are used directly from the file pages
+	* instead of being read and copied, so loading is faster and memory is shared with other processes using the same file.
+	*/
+	UPROPERTY(GlobalConfig, EditAnywhere, Category = "Performance")
+	bool bMemoryMapModel = true;
+
+	/**
+	* Quantize F16 weights of the model while loading it. Quantized weights are 2-3 times smaller, so recognition
+	* needs less memory and memory bandwidth (the main bottleneck on mobile devices) at the cost of some accuracy.
+	* Models which are already quantized are loaded as is.
+	*/
+	UPROPERTY(GlobalConfig, EditAnywhere, Category = "Performance")
+	EWhisperQuantization QuantizeOnLoad = EWhisperQuantization::None;
+
+	/**
+	* Save quantized model to Saved/Whisper folder and load it from there next time,
+	* so quantization is done only once. The cached model can be memory-mapped.
+	*/
+	UPROPERTY(GlobalConfig, EditAnywhere, Category = "Performance", meta = (EditCondition = "QuantizeOnLoad != EWhisperQuantization::None"))
+	bool bCacheQuantizedModel = true;
+
+	/**
+	* Recognize two seconds of silence with every recognition state after the model is loaded, before it's reported as ready.
+	* The first real request doesn't need to allocate compute buffers and page in the weights, so it's as fast as the next ones.
+	*/
+	UPROPERTY(GlobalConfig, EditAnywhere, Category = "Performance")
+	bool bWarmUpModel = true;
+
+	/**
+	* Memory used to keep encoder outputs of recently recognized audio (MB). Recognition of the same audio again,
+	* i. e. with another language or decoding settings, skips the encoder. Every cached window takes
+	* 2 x audio context x text layers x text state x 2 bytes plus audio context x text state x 4 bytes
+	* (about 21 MB for the base model and full context).
+	* Mostly useful in editor, where the same audio is often recognized again. 0 = disable.
+	*/
+	UPROPERTY(GlobalConfig, EditAnywhere, Category = "Performance", meta = (ClampMin = "0", UIMax = "4096"))
+	int32 EncoderCacheSizeMB = 0;
+
+	/**
+	* Save recognition results to Saved/Whisper/Transcriptions and reuse them for the same audio, model and recognition
+	* settings without any processing, so lip-sync of unchanged voice lines is regenerated instantly. Editor only:
+	* live audio recognized in game is rarely repeated.
+	*/
+	UPROPERTY(GlobalConfig, EditAnywhere, Category = "Performance")
+	bool bCacheTranscriptions = true;
+
+	/** Maximum size of Saved/Whisper/Transcriptions (MB); least recently used results are deleted when it's exceeded */
+	UPROPERTY(GlobalConfig, EditAnywhere, Category = "Performance", meta = (EditCondition = "bCacheTranscriptions", ClampMin = "1", UIMax = "4096"))
+	int32 TranscriptionCacheSizeMB = 256;
+
+	/** Decoding strategy */
+	UPROPERTY(GlobalConfig, EditAnywhere, Category = "Decoding")
+	EWhisperSamplingStrategy SamplingStrategy = EWhisperSamplingStrategy::Greedy;
+
+	/** Number of candidates when sampling with non-zero temperature */
+	UPROPERTY(GlobalConfig, EditAnywhere, Category = "Decoding", meta = (ClampMin = "1", ClampMax = "8"))
+	int32 BestOf = 5;
+
+	/** Number of beams in beam search */
+	UPROPERTY(GlobalConfig, EditAnywhere, Category = "Decoding", meta = (EditCondition = "SamplingStrategy == EWhisperSamplingStrategy::BeamSearch", ClampMin = "1", ClampMax = "8"))
+	int32 BeamSize = 5;
+
+	/** Initial sampling temperature */
+	UPROPERTY(GlobalConfig, EditAnywhere, Category = "Decoding", meta = (ClampMin = "0.0", ClampMax = "1.0"))
+	float Temperature = 0.f;
+
+	/** Temperature increment used for fallback when decoding fails. 0 = disable fallback. */
+	UPROPERTY(GlobalConfig, EditAnywhere, Category = "Decoding", meta = (ClampMin = "0.0", ClampMax = "1.0"))
+	float TemperatureIncrement = 0.4f;
+
+	/** Fallback to higher temperature if entropy of decoded text is lower than this value */
+	UPROPERTY(GlobalConfig, EditAnywhere, Category = "Decoding")
+	float EntropyThreshold = 2.4f;
+
+	/** Fallback to higher temperature if average log probability of decoded tokens is lower than this value */
+	UPROPERTY(GlobalConfig, EditAnywhere, Category = "Decoding")
+	float LogProbThreshold = -1.f;
+
+	/**
+	* If language is "auto", remember the language detected for every sender (or speaker, see UWhisperSubsystem::SetSenderSpeaker)
+	* and live stream, and skip language detection in its next requests.
+	*/
+	UPROPERTY(GlobalConfig, EditAnywhere, Category = "Language")
+	bool bCacheDetectedLanguage = true;
+
+	/**
+	* Language is detected again when its confidence drops below this value. Confidence starts with the probability
+	* of the detected language and then follows average probability of tokens recognized in this language.
+	*/
+	UPROPERTY(GlobalConfig, EditAnywhere, Category = "Language", meta = (EditCondition = "bCacheDetectedLanguage", ClampMin = "0.0", ClampMax = "1.0"))
+	float LanguageConfidenceThreshold = 0.6f;
+
+	/**
+	* Remove silence from audio before recognition. Only voiced parts of audio (separated by a short pause)
+	* are processed by whisper, time marks of recognized words are converted back to the original audio.
+	* Faster for long recordings with pauses, but words cut by the detector can be lost.
+	*/
+	UPROPERTY(GlobalConfig, EditAnywhere, Category = "Voice Activity Detection")
+	bool bVoiceActivityDetection = false;
+
+	/** Audio is voiced if it's louder than the background noise by this value (dB) */
+	UPROPERTY(GlobalConfig, EditAnywhere, Category = "Voice Activity Detection", meta = (EditCondition = "bVoiceActivityDetection", ClampMin = "3.0", ClampMax = "40.0"))
+	float VADEnergyThreshold = 12.f;
+
+	/** Shorter pauses between words aren't removed (ms) */
+	UPROPERTY(GlobalConfig, EditAnywhere, Category = "Voice Activity Detection", meta = (EditCondition = "bVoiceActivityDetection", ClampMin = "50", ClampMax = "5000"))
+	int32 VADMinSilenceMs = 300;
+
+	/** Audio kept before and after every voiced part (ms) */
+	UPROPERTY(GlobalConfig, EditAnywhere, Category = "Voice Activity Detection", meta = (EditCondition = "bVoiceActivityDetection", ClampMin = "0", ClampMax = "1000"))
+	int32 VADPaddingMs = 150;
+
+	/** Interval between recognition passes over live audio stream (ms). Smaller values reduce latency, but cost more CPU time. */
+	UPROPERTY(GlobalConfig, EditAnywhere, Category = "Streaming", meta = (ClampMin = "100", ClampMax = "5000"))
+	int32 StreamStepMs = 500;
+
+	/**
+	* Maximum length of audio window recognized in every streaming pass (ms). If words aren't confirmed
+	* for this time, words in the older half of the window are committed anyway.
+	*/
+	UPROPERTY(GlobalConfig, EditAnywhere, Category = "Streaming", meta = (ClampMin = "2000", ClampMax = "30000"))
+	int32 StreamWindowMs = 10000;
+
+	/** Audio before the last committed word kept in the streaming window as context (ms) */
+	UPROPERTY(GlobalConfig, EditAnywhere, Category = "Streaming", meta = (ClampMin = "0", ClampMax = "2000"))
+	int32 StreamOverlapMs = 200;
 	
 private:
 	void MakeFullPath(FString& InOutPath) const;